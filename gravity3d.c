@@ -21,16 +21,34 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA.*/
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include <png.h>
+#include <zlib.h>
 
+#define GL_GLEXT_PROTOTYPES // instancing entry points are taken from libGL
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <GL/glut.h>
 
 #define WINDOW_TITLE_PREFIX "Gravity simulation"
 #define couleur(param) printf("\033[%sm",param)
-#define BUFSIZE 512
-#define MAXOBJECTS 5000
+#define PICKLEAF 4 // spheres per leaf of the picking hierarchy
+#define CAPTURESLOTS 3 // frames read back at the same time
+#define ENCODERS 2 // PNG encoder threads
+#define ENCODEQUEUE 16 // frames waiting for an encoder before the window waits
+#define VIDEORATE 25 // frames per second announced in the Y4M header
+#define TRAJECTORYVERSION 2
+#define TRAJECTORYHEADER 40 // bytes of the file header
+#define TRAJECTORYBLOCK 64 // bytes of a block header
+#define TRAJECTORYCHUNK 16 // steps per compressed block of the trajectory file
+#define TRAJECTORYQUEUE 4 // steps waiting for the trajectory writer before the simulation waits
+#define TRAJECTORYSHIFT 6 // a position quantum is 2^TRAJECTORYSHIFT velocity quanta
+#define SPHERESTEPS 12 // slices and stacks of the sphere mesh
+#define SNAPSHOTFRESH 4 // latestSnapshot flag of a step the renderer has not taken
 
 static short winSizeW = 1200,
 	winSizeH = 900,
@@ -47,8 +65,12 @@ static short winSizeW = 1200,
 
 static int textList = 0,
 	cpt = 0,
-	pathLength = 0,
+	pathLength = 0, // filled trail slots
+	pathHead = 0, // trail slot of the current positions
 	maxPathLength = 50,
+	nbThreads = 0,
+	batchSteps = 0, // steps of the headless batch mode, 0 opens the window
+	blockSize = 128, // bodies per pool task
 	sampleSize = 1200;
 
 static float fps = 0.0,
@@ -72,20 +94,222 @@ typedef struct _vector {
 	double x, y, z;
 } vector;
 
-typedef struct _objects {
-	vector pos;
-	vector color;
-	vector velocity;
-	vector force;
-	vector *path;
-	double radius;
-	double mass;
-	int id;
-	short selected;
-} objects;
-
-
-static objects objectsList[MAXOBJECTS];
+// structure of arrays, every array is aligned for vector loads; mass, radius,
+// color and selected are shared by the two buffers
+typedef struct _particles {
+	double *x, *y, *z;
+	double *vx, *vy, *vz;
+	double *mass;
+	double *radius;
+	vector *color;
+	short *selected;
+} particles;
+
+
+// bodies are read from objectsList and written to nextList, swapped every step
+static particles objectsBuffer[2];
+static particles *objectsList = &objectsBuffer[0],
+	*nextList = &objectsBuffer[1];
+
+// trails of all bodies in one ring of maxPathLength slots, a step fills one
+// slot and the point of body o in slot s is at 3 * (s * sampleSize + o)
+static float *pathArena = NULL;
+
+// snapshots drawn by the window: the sim thread fills the back one, the
+// renderer draws the front one and latestSnapshot is the index of the last
+// complete step, the three are swapped with atomic exchanges and never locked;
+// a snapshot also carries, in the slots of the arena, the trail points of the
+// steps the renderer has not taken yet, so the sim never waits for it
+typedef struct _snapshot {
+	double *x, *y, *z;
+	double *vx, *vy, *vz;
+	double *radius;
+	vector *color;
+	short *selected;
+	float *trail;
+	int pathHead, pathLength;
+	long steps,
+		trailFirst; // first step whose points are in trail
+} snapshot;
+
+static snapshot snapshots[3];
+static snapshot *view = &snapshots[0];
+static int backSnapshot = 1,
+	frontSnapshot = 0;
+static atomic_int latestSnapshot = 2;
+static long stepCount = 0,
+	shownSteps = 0;
+static double stepPeriod = 0.0, // minimum milliseconds per step in the window, 0 runs free
+	stepRate = 0.0;
+static pthread_t simThread;
+static atomic_int simStop = 0; // ends the sim thread after its step
+static atomic_long trailShown = -1; // last step uploaded by the renderer, the sim only reads it
+
+// spheres share one unit mesh drawn once per body with instancing, the
+// instance buffer holds x, y, z, radius, r, g, b for every body; without
+// instancing a display list of the mesh is called per body
+static GLuint sphereList = 0,
+	sphereProgram = 0, // 0 when instancing is unavailable
+	sphereBuffers[3]; // mesh vertices, mesh indices and instances
+static GLint sphereVertex = 0,
+	sphereInstance = 0,
+	sphereTint = 0;
+static int sphereIndices = 0;
+static float *instanceData = NULL;
+
+// the trail arena mirrored in buffers of the same slot layout, with the colour
+// of each body at the time its point was uploaded; only the slots written by
+// the steps since the last upload are sent from the snapshot; a full ring is
+// drawn body by body through the indices, rasterizers such as llvmpipe are
+// twice as fast on points that are close on screen
+static GLuint trailBuffers[3]; // positions, colours and body-major indices
+static long trailSteps = -1; // step of the last upload
+static unsigned char *trailColors = NULL;
+
+// picking casts the cursor ray against a bounding volume hierarchy of the
+// drawn spheres, built on a click when a newer step is drawn; node n covers
+// the spheres pickIndex[pickFirst[n]] to pickIndex[pickLast[n] - 1], its box
+// is pickLo/pickHi[3*n] and its children are 2n+1 and 2n+2
+static int *pickIndex = NULL,
+	*pickFirst = NULL,
+	*pickLast = NULL,
+	boxActive = 0, // right drag in progress, corners in window coordinates
+	boxX0 = 0,
+	boxY0 = 0,
+	boxX1 = 0,
+	boxY1 = 0;
+static double *pickLo = NULL,
+	*pickHi = NULL;
+static long pickSteps = -1;
+static GLdouble pickModel[16],
+	pickProjection[16];
+static GLint pickPort[4];
+
+// captures are read back into pixel buffers without waiting and mapped
+// CAPTURESLOTS - 1 frames later, then PNG encoders take them from a queue;
+// offscreen frames come with a scene that the encoder draws first
+typedef struct _capture {
+	unsigned char *pixels;
+	float *scene; // x, y, z, radius, r, g, b of each body, NULL for read backs
+	int count; // bodies in scene
+	int width, height;
+	short verbose; // screenshots are reported, recorded frames are not
+	char name[32];
+} capture;
+
+static GLuint captureBuffers[CAPTURESLOTS];
+static capture captureSlots[CAPTURESLOTS];
+static long captureIssued[CAPTURESLOTS], // frame of each read back, -1 when free
+	captureFrame = 0;
+static int captureNext = 0,
+	recording = 0,
+	recordCount = 0,
+	encodeHead = 0,
+	encodeCount = 0,
+	encodeActive = 0;
+static char screenshotName[32] = "";
+static int renderEvery = 0, // steps between two offscreen frames of the batch mode, 0 draws none
+	renderCount = 0;
+static double renderView[12]; // rows of the offscreen camera, the initial one of the window
+
+// with a video, recorded and offscreen frames go to one writer thread in
+// order and are streamed as YUV 4:2:0 instead of PNG files
+static FILE *video = NULL;
+static char *videoName = NULL;
+static unsigned char *videoPlanes = NULL;
+static int videoWidth = 0, // set by the first frame, later frames of another size are skipped
+	videoHeight = 0,
+	videoFrames = 0,
+	videoHead = 0,
+	videoCount = 0,
+	videoActive = 0;
+static capture videoQueue[ENCODEQUEUE];
+static pthread_t videoThread;
+static pthread_cond_t videoWake = PTHREAD_COND_INITIALIZER;
+
+// trajectory file, little endian with the layout given in README.md: a
+// header, then blocks of up to TRAJECTORYCHUNK steps, each a block header and
+// six zlib streams of zigzag varints, the columns x, y, z, vx, vy, vz in step
+// then body order; positions are counted in quanta of 1/1024 and velocities
+// of 1/65536, a velocity is stored as its change since the previous step and
+// a position as its distance to the previous one moved by the current
+// velocity, the first step of a block as is
+typedef struct _trajectoryHeader {
+	char magic[8];
+	int version,
+		bodies,
+		chunkSteps,
+		columns;
+	double positionQuantum,
+		velocityQuantum;
+} trajectoryHeader;
+
+typedef struct _trajectoryChunk {
+	long firstStep;
+	int steps,
+		reserved;
+	long size[6]; // compressed bytes of each column
+} trajectoryChunk;
+
+static FILE *trajectory = NULL,
+	*dumpOutput = NULL; // text output of -X
+static char *trajectoryName = NULL,
+	*dumpName = NULL;
+static double *trajectoryColumns[TRAJECTORYQUEUE][6]; // copies of the queued steps
+static long trajectoryStep[TRAJECTORYQUEUE],
+	trajectoryBytes = 0;
+static int trajectoryHead = 0,
+	trajectoryCount = 0,
+	trajectoryClosing = 0,
+	trajectoryWritten = 0;
+static pthread_t trajectoryThread;
+static pthread_mutex_t trajectoryMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trajectoryWake = PTHREAD_COND_INITIALIZER,
+	trajectoryRoom = PTHREAD_COND_INITIALIZER;
+static capture encodeQueue[ENCODEQUEUE];
+static pthread_t encoders[ENCODERS];
+static pthread_mutex_t encodeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t encodeWake = PTHREAD_COND_INITIALIZER,
+	encodeRoom = PTHREAD_COND_INITIALIZER;
+
+// GLSL 1.20 lights every vertex like the fixed pipeline, with its lights and material
+static const char *sphereVertexShader =
+	"#version 120\n"
+	"attribute vec3 vertex;\n"
+	"attribute vec4 instance;\n"
+	"attribute vec3 tint;\n"
+	"void main() {\n"
+	"	vec4 p = gl_ModelViewMatrix * vec4(instance.xyz + instance.w * vertex, 1.0);\n"
+	"	vec3 n = normalize(gl_NormalMatrix * vertex), v = normalize(-p.xyz), l;\n"
+	"	vec3 c = tint * gl_LightModel.ambient.rgb;\n"
+	"	for (int i=0; i<2; i++) {\n"
+	"		l = normalize(gl_LightSource[i].position.xyz - p.xyz);\n"
+	"		c += tint * (gl_LightSource[i].ambient.rgb + gl_LightSource[i].diffuse.rgb * max(dot(n, l), 0.0));\n"
+	"		if (dot(n, l) > 0.0) {\n"
+	"			c += gl_FrontMaterial.specular.rgb * gl_LightSource[i].specular.rgb * pow(max(dot(n, normalize(l + v)), 0.0), gl_FrontMaterial.shininess);\n"
+	"		}\n"
+	"	}\n"
+	"	gl_FrontColor = vec4(c, 1.0);\n"
+	"	gl_Position = gl_ProjectionMatrix * p;\n"
+	"}\n";
+static const char *sphereFragmentShader =
+	"#version 120\n"
+	"void main() {\n"
+	"	gl_FragColor = gl_Color;\n"
+	"}\n";
+
+// thread pool running numbered tasks, the calling thread takes part
+typedef void (*taskFunc)(int task);
+
+static pthread_t *workers = NULL;
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER,
+	poolDone = PTHREAD_COND_INITIALIZER;
+static taskFunc poolFunc = NULL;
+static int poolTasks = 0,
+	poolNext = 0,
+	poolFinished = 0,
+	poolGeneration = 0;
 
 
 
@@ -103,11 +327,23 @@ void help(void) {
 	printf("\t'z' and 'Z' to zoom in or out\n");
 	printf("\t'f' to switch to full screen\n");
 	printf("\t'p' to take a screenshot\n");
+	printf("\t'c' to start or stop recording every frame to numbered PNG files\n");
 	printf("\t'd' to display axe or not\n");
 	printf("\t't' to display selected object trace or not\n");
 	printf("\t'a' to display trace of all objects\n");
 	printf("Mouse usage:\n");
 	printf("\t'LEFT CLICK' to select an object\n");
+	printf("\t'RIGHT DRAG' to select the objects inside a box\n");
+	printf("Options:\n");
+	printf("\t'-j threads' number of worker threads (default all cores)\n");
+	printf("\t'-b steps' run steps without a window and report the steps per second\n");
+	printf("\t'-o every' with -b, draw a %dx%d frame every given steps to frame_NNNNN.png without a display\n", winSizeW, winSizeH);
+	printf("\t'-v file' stream the recorded or offscreen frames to file as Y4M video instead of PNG files, '-' for the standard output\n");
+	printf("\t'-x file' write the positions and velocities of every step to file, compressed by blocks of %d steps in the background\n", TRAJECTORYCHUNK);
+	printf("\t'-X file' print the steps of a trajectory written by -x as text on the standard output and quit\n");
+	printf("\t'-d period' minimum milliseconds per step in the window (default 0, as fast as possible)\n");
+	printf("\t'-n count' number of bodies (default %d)\n", sampleSize);
+	printf("\t'-r points' trail length in steps (default %d)\n", maxPathLength);
 	printf("\n");
 }
 
@@ -205,73 +441,1317 @@ vector limitForce(vector v, double max) {
 }
 
 
-double distance(objects o1, objects o2) {
+void *alignedArray(int n, size_t size) {
+	// arrays of 2 MiB or more are backed by reserved huge pages when there are
+	// some, otherwise transparent huge pages are requested for them
+	void *r = NULL;
+	size_t bytes = (size_t)n * size,
+		huge = 2 * 1024 * 1024;
+	if (bytes >= huge) {
+		bytes = ((bytes + huge - 1) / huge) * huge;
+#ifdef MAP_HUGETLB
+		r = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (r != MAP_FAILED) {
+			return(r);
+		}
+#endif
+		if (posix_memalign(&r, huge, bytes)) {
+			printf("ERROR: unable to allocate %d elements\n", n);
+			exit(EXIT_FAILURE);
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(r, bytes, MADV_HUGEPAGE);
+#endif
+	} else if (posix_memalign(&r, 64, bytes)) {
+		printf("ERROR: unable to allocate %d elements\n", n);
+		exit(EXIT_FAILURE);
+	}
+	memset(r, 0, bytes);
+	return(r);
+}
+
+
+vector getPos(particles *p, int i) {
 	vector r;
-	r = subVec(o2.pos, o1.pos);
-	return(magnitude(r));
+	r.x = p->x[i];
+	r.y = p->y[i];
+	r.z = p->z[i];
+	return(r);
 }
 
 
-void takeScreenshot(char *filename) {
-	FILE *fp = fopen(filename, "wb");
-	int width = glutGet(GLUT_WINDOW_WIDTH);
-	int height = glutGet(GLUT_WINDOW_HEIGHT);
-	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	png_infop info = png_create_info_struct(png);
-	unsigned char *buffer = calloc((width * height * 3), sizeof(unsigned char));
-	int i;
+double distance(particles *p, int o1, int o2) {
+	double dx = p->x[o2] - p->x[o1],
+		dy = p->y[o2] - p->y[o1],
+		dz = p->z[o2] - p->z[o1];
+	return(sqrt((dx * dx) + (dy * dy) + (dz * dz)));
+}
+
 
-	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, (GLvoid *)buffer);
+void allocateObjects(void) {
+	int b = 0;
+	for (b=0; b<2; b++) {
+		objectsBuffer[b].x = alignedArray(sampleSize, sizeof(double));
+		objectsBuffer[b].y = alignedArray(sampleSize, sizeof(double));
+		objectsBuffer[b].z = alignedArray(sampleSize, sizeof(double));
+		objectsBuffer[b].vx = alignedArray(sampleSize, sizeof(double));
+		objectsBuffer[b].vy = alignedArray(sampleSize, sizeof(double));
+		objectsBuffer[b].vz = alignedArray(sampleSize, sizeof(double));
+	}
+	objectsBuffer[0].mass = alignedArray(sampleSize, sizeof(double));
+	objectsBuffer[0].radius = alignedArray(sampleSize, sizeof(double));
+	objectsBuffer[0].color = alignedArray(sampleSize, sizeof(vector));
+	objectsBuffer[0].selected = alignedArray(sampleSize, sizeof(short));
+	objectsBuffer[1].mass = objectsBuffer[0].mass;
+	objectsBuffer[1].radius = objectsBuffer[0].radius;
+	objectsBuffer[1].color = objectsBuffer[0].color;
+	objectsBuffer[1].selected = objectsBuffer[0].selected;
+}
+
+
+void allocateSnapshots(void) {
+	// the radius and selection flags are shared by all the snapshots
+	int f = 0;
+	for (f=0; f<3; f++) {
+		snapshots[f].x = alignedArray(sampleSize, sizeof(double));
+		snapshots[f].y = alignedArray(sampleSize, sizeof(double));
+		snapshots[f].z = alignedArray(sampleSize, sizeof(double));
+		snapshots[f].vx = alignedArray(sampleSize, sizeof(double));
+		snapshots[f].vy = alignedArray(sampleSize, sizeof(double));
+		snapshots[f].vz = alignedArray(sampleSize, sizeof(double));
+		snapshots[f].color = alignedArray(sampleSize, sizeof(vector));
+		snapshots[f].radius = objectsList->radius;
+		snapshots[f].selected = objectsList->selected;
+		snapshots[f].trail = alignedArray(3 * maxPathLength, sampleSize * sizeof(float));
+		snapshots[f].trailFirst = 0;
+		snapshots[f].steps = -1;
+	}
+}
+
+
+void publishSnapshot(void) {
+	// sim thread side, the filled snapshot becomes the latest one
+	snapshot *f = &snapshots[backSnapshot];
+	size_t size = 3 * (size_t)sampleSize;
+	long s = 0,
+		last = f->steps,
+		from = atomic_load(&trailShown) + 1;
+	int slot = 0;
+	memcpy(f->x, objectsList->x, sampleSize * sizeof(double));
+	memcpy(f->y, objectsList->y, sampleSize * sizeof(double));
+	memcpy(f->z, objectsList->z, sampleSize * sizeof(double));
+	memcpy(f->vx, objectsList->vx, sampleSize * sizeof(double));
+	memcpy(f->vy, objectsList->vy, sampleSize * sizeof(double));
+	memcpy(f->vz, objectsList->vz, sampleSize * sizeof(double));
+	memcpy(f->color, objectsList->color, sampleSize * sizeof(vector));
+	f->pathHead = pathHead;
+	f->pathLength = pathLength;
+	f->steps = stepCount;
+	// the points of the steps after the last upload that are still in the
+	// arena, a recycled snapshot already holds most of them when the renderer
+	// falls behind, so only a few slots are copied per step
+	if (from < stepCount - pathLength + 1) {
+		from = stepCount - pathLength + 1;
+	}
+	for (s=from; s<=stepCount; s++) {
+		if ((s < f->trailFirst) | (s > last)) {
+			slot = (pathHead - (int)(stepCount - s) + maxPathLength) % maxPathLength;
+			memcpy(&f->trail[slot * size], &pathArena[slot * size], size * sizeof(float));
+		}
+	}
+	f->trailFirst = from;
+	backSnapshot = atomic_exchange(&latestSnapshot, backSnapshot | SNAPSHOTFRESH) & 3;
+}
+
+
+void acquireSnapshot(void) {
+	// renderer side, takes the latest snapshot if a step has completed since
+	if (atomic_load(&latestSnapshot) & SNAPSHOTFRESH) {
+		frontSnapshot = atomic_exchange(&latestSnapshot, frontSnapshot) & 3;
+		view = &snapshots[frontSnapshot];
+	}
+}
+
+
+void stopSimulation(void) {
+	// the sim thread ends after its current step, nothing feeds the writers then
+	atomic_store(&simStop, 1);
+	pthread_join(simThread, NULL);
+}
+
+
+void initRender(void) {
+	// modelview of the window before any key is pressed: the translation by
+	// (xx, yy, -zoom) then the rotations about x, y and z
+	double cx = cos(rotx * pi / 180.0), sx = sin(rotx * pi / 180.0),
+		cy = cos(roty * pi / 180.0), sy = sin(roty * pi / 180.0),
+		cz = cos(rotz * pi / 180.0), sz = sin(rotz * pi / 180.0);
+	double m[12] = {
+		cy * cz, -cy * sz, sy, xx,
+		cx * sz + sx * sy * cz, cx * cz - sx * sy * sz, -sx * cy, yy,
+		sx * sz - cx * sy * cz, sx * cz + cx * sy * sz, cx * cy, -zoom};
+	memcpy(renderView, m, sizeof(m));
+}
+
+
+void renderLine(capture *c, float *depth, double *a, double *b) {
+	// segment between two projected points (x, y, distance) in grey, depth tested
+	int i = 0, n = 0, x = 0, y = 0;
+	double t = 0.0, d = 0.0;
+	n = (int)fmax(fabs(b[0] - a[0]), fabs(b[1] - a[1])) + 1;
+	for (i=0; i<=n; i++) {
+		t = (double)i / n;
+		x = (int)(a[0] + t * (b[0] - a[0]));
+		y = (int)(a[1] + t * (b[1] - a[1]));
+		d = a[2] + t * (b[2] - a[2]);
+		if ((x >= 0) && (x < c->width) && (y >= 0) && (y < c->height) && (d < depth[y * c->width + x])) {
+			depth[y * c->width + x] = d;
+			memset(&c->pixels[3 * (y * c->width + x)], 102, 3);
+		}
+	}
+}
+
+
+void renderScene(capture *c) {
+	// CPU rasterizer of the offscreen frames: the bodies are lit discs with a
+	// per pixel depth and the same lights and material as the window
+	int i = 0, j = 0, k = 0, x = 0, y = 0, x0 = 0, x1 = 0, y0 = 0, y1 = 0;
+	double *v = renderView;
+	double focal = 0.5 * c->height / tan(45.0 * pi / 360.0), // 45 degrees of field of view
+		corner[8][3];
+	double ex = 0.0, ey = 0.0, ez = 0.0, px = 0.0, py = 0.0, r = 0.0, dx = 0.0, dy = 0.0, q = 0.0, nz = 0.0, spec = 0.0, z = 0.0, light = 0.0;
+	float *s = NULL,
+		*depth = malloc((size_t)c->width * c->height * sizeof(float));
+	unsigned char *pixel = NULL;
+	c->pixels = malloc(3 * (size_t)c->width * c->height);
+	memset(c->pixels, 26, 3 * (size_t)c->width * c->height);
+	for (i=0; i<c->width*c->height; i++) {
+		depth[i] = 1000.0;
+	}
+	if (axe) {
+		for (i=0; i<8; i++) {
+			ex = (i & 1) ? 150.0 : -150.0;
+			ey = (i & 2) ? 150.0 : -150.0;
+			ez = (i & 4) ? 150.0 : -150.0;
+			z = -(v[8] * ex + v[9] * ey + v[10] * ez + v[11]);
+			corner[i][0] = 0.5 * c->width + focal * (v[0] * ex + v[1] * ey + v[2] * ez + v[3]) / z;
+			corner[i][1] = 0.5 * c->height + focal * (v[4] * ex + v[5] * ey + v[6] * ez + v[7]) / z;
+			corner[i][2] = z;
+		}
+		for (i=0; i<8; i++) {
+			for (j=1; j<8; j<<=1) {
+				if (!(i & j) && (corner[i][2] > 1.0) && (corner[i | j][2] > 1.0)) {
+					renderLine(c, depth, corner[i], corner[i | j]);
+				}
+			}
+		}
+	}
+	for (i=0; i<c->count; i++) {
+		s = &c->scene[7*i];
+		ex = v[0] * s[0] + v[1] * s[1] + v[2] * s[2] + v[3];
+		ey = v[4] * s[0] + v[5] * s[1] + v[6] * s[2] + v[7];
+		ez = -(v[8] * s[0] + v[9] * s[1] + v[10] * s[2] + v[11]);
+		if ((ez - s[3] < 1.0) || (ez > 1000.0)) {
+			continue;
+		}
+		px = 0.5 * c->width + focal * ex / ez;
+		py = 0.5 * c->height + focal * ey / ez;
+		r = focal * s[3] / ez;
+		if (r < 0.5) {
+			r = 0.5; // far bodies still cover their pixel
+		}
+		x0 = (int)fmax(px - r, 0.0);
+		x1 = (int)fmin(px + r, c->width - 1.0);
+		y0 = (int)fmax(py - r, 0.0);
+		y1 = (int)fmin(py + r, c->height - 1.0);
+		for (y=y0; y<=y1; y++) {
+			for (x=x0; x<=x1; x++) {
+				dx = (x + 0.5 - px) / r;
+				dy = (y + 0.5 - py) / r;
+				q = 1.0 - dx * dx - dy * dy;
+				if (q <= 0.0) {
+					continue;
+				}
+				nz = sqrt(q);
+				z = ez - nz * s[3];
+				if (z >= depth[y * c->width + x]) {
+					continue;
+				}
+				depth[y * c->width + x] = z;
+				// ambient of the model and of both lights, then their diffuse
+				// and specular terms with the lights next to the eye
+				light = 0.7 + 1.6 * nz;
+				spec = nz;
+				for (k=0; k<7; k++) {
+					spec *= spec;
+				}
+				spec *= 1.6 * 255.0;
+				pixel = &c->pixels[3 * (y * c->width + x)];
+				pixel[0] = (unsigned char)fmin(255.0 * s[4] * light + spec, 255.0);
+				pixel[1] = (unsigned char)fmin(255.0 * s[5] * light + spec, 255.0);
+				pixel[2] = (unsigned char)fmin(255.0 * s[6] * light + spec, 255.0);
+			}
+		}
+	}
+	free(depth);
+}
+
+
+void writePng(capture *c) {
+	FILE *fp = fopen(c->name, "wb");
+	png_structp png = NULL;
+	png_infop info = NULL;
+	int i;
+	if (fp == NULL) {
+		printf("INFO: cannot write %s\n", c->name);
+		return;
+	}
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info = png_create_info_struct(png);
 	png_init_io(png, fp);
-	png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_IHDR(png, info, c->width, c->height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	if (!c->verbose) {
+		// recorded frames favour encoding speed over size
+		png_set_compression_level(png, 1);
+		png_set_filter(png, 0, PNG_FILTER_SUB);
+	}
 	png_write_info(png, info);
-	for (i=0; i<height; i++) {
-		png_write_row(png, &(buffer[3*width*((height-1) - i)]));
+	for (i=0; i<c->height; i++) {
+		png_write_row(png, &(c->pixels[3*c->width*((c->height-1) - i)]));
 	}
 	png_write_end(png, NULL);
 	png_destroy_write_struct(&png, &info);
-	free(buffer);
 	fclose(fp);
-	printf("INFO: Save screenshot on %s (%d x %d)\n", filename, width, height);
+	if (c->verbose) {
+		printf("INFO: Save screenshot on %s (%d x %d)\n", c->name, c->width, c->height);
+	}
+}
+
+
+void openVideo(void) {
+	// "-" streams to the standard output, which then carries the video only:
+	// it is duplicated and fd 1 becomes stderr, so printf, including the help
+	// still buffered, goes there
+	int fd = 0;
+	char *name = videoName;
+	if (strcmp(name, "-") == 0) {
+		videoName = "the standard output";
+		fd = dup(STDOUT_FILENO);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		video = fdopen(fd, "wb");
+	} else {
+		video = fopen(name, "wb");
+	}
+	if (video == NULL) {
+		printf("ERROR: cannot write the video to %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+void writeVideo(capture *c) {
+	// converts to full range BT.601 YUV, chroma averaged over 2x2 pixels, and
+	// flips the rows: Y4M frames are stored from the top
+	int x = 0, y = 0, r = 0, g = 0, b = 0;
+	unsigned char *p = NULL, *q = NULL,
+		*lum = NULL, *cb = NULL, *cr = NULL;
+	if (videoWidth == 0) {
+		videoWidth = c->width & ~1;
+		videoHeight = c->height & ~1;
+		videoPlanes = malloc(3 * (size_t)videoWidth * videoHeight / 2);
+		fprintf(video, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", videoWidth, videoHeight, VIDEORATE);
+	}
+	if (((c->width & ~1) != videoWidth) || ((c->height & ~1) != videoHeight)) {
+		printf("INFO: frame of %d x %d skipped, the video is %d x %d\n", c->width, c->height, videoWidth, videoHeight);
+		return;
+	}
+	lum = videoPlanes;
+	cb = lum + (size_t)videoWidth * videoHeight;
+	cr = cb + (size_t)videoWidth * videoHeight / 4;
+	for (y=0; y<videoHeight; y+=2) {
+		p = &c->pixels[3 * (size_t)c->width * (c->height - 1 - y)];
+		q = p - 3 * (size_t)c->width;
+		for (x=0; x<videoWidth; x+=2) {
+			lum[y*videoWidth+x] = (77 * p[3*x] + 150 * p[3*x+1] + 29 * p[3*x+2] + 128) >> 8;
+			lum[y*videoWidth+x+1] = (77 * p[3*x+3] + 150 * p[3*x+4] + 29 * p[3*x+5] + 128) >> 8;
+			lum[(y+1)*videoWidth+x] = (77 * q[3*x] + 150 * q[3*x+1] + 29 * q[3*x+2] + 128) >> 8;
+			lum[(y+1)*videoWidth+x+1] = (77 * q[3*x+3] + 150 * q[3*x+4] + 29 * q[3*x+5] + 128) >> 8;
+			r = p[3*x] + p[3*x+3] + q[3*x] + q[3*x+3];
+			g = p[3*x+1] + p[3*x+4] + q[3*x+1] + q[3*x+4];
+			b = p[3*x+2] + p[3*x+5] + q[3*x+2] + q[3*x+5];
+			cb[(y/2)*(videoWidth/2)+x/2] = (128 * 1024 - 43 * r - 85 * g + 128 * b + 512) >> 10;
+			cr[(y/2)*(videoWidth/2)+x/2] = (128 * 1024 + 128 * r - 107 * g - 21 * b + 512) >> 10;
+		}
+	}
+	fputs("FRAME\n", video);
+	fwrite(videoPlanes, 1, 3 * (size_t)videoWidth * videoHeight / 2, video);
+	fflush(video); // an encoder reading a pipe gets every frame at once
+	videoFrames++;
+}
+
+
+void *videoWorker(void *arg) {
+	capture job;
+	(void)arg;
+	pthread_mutex_lock(&encodeMutex);
+	for (;;) {
+		while (videoCount == 0) {
+			pthread_cond_wait(&videoWake, &encodeMutex);
+		}
+		job = videoQueue[videoHead];
+		videoHead = (videoHead + 1) % ENCODEQUEUE;
+		videoCount--;
+		videoActive++;
+		pthread_mutex_unlock(&encodeMutex);
+		if (job.scene != NULL) {
+			renderScene(&job);
+			free(job.scene);
+		}
+		writeVideo(&job);
+		free(job.pixels);
+		pthread_mutex_lock(&encodeMutex);
+		videoActive--;
+		pthread_cond_broadcast(&encodeRoom);
+	}
+	return(NULL);
+}
+
+
+void *encoderWorker(void *arg) {
+	capture job;
+	(void)arg;
+	pthread_mutex_lock(&encodeMutex);
+	for (;;) {
+		while (encodeCount == 0) {
+			pthread_cond_wait(&encodeWake, &encodeMutex);
+		}
+		job = encodeQueue[encodeHead];
+		encodeHead = (encodeHead + 1) % ENCODEQUEUE;
+		encodeCount--;
+		encodeActive++;
+		pthread_mutex_unlock(&encodeMutex);
+		if (job.scene != NULL) {
+			renderScene(&job);
+			free(job.scene);
+		}
+		writePng(&job);
+		free(job.pixels);
+		pthread_mutex_lock(&encodeMutex);
+		encodeActive--;
+		pthread_cond_broadcast(&encodeRoom);
+	}
+	return(NULL);
+}
+
+
+void queueCapture(capture *c) {
+	// waits only when every encoder is behind by ENCODEQUEUE frames
+	pthread_mutex_lock(&encodeMutex);
+	if ((video != NULL) && !c->verbose) {
+		while (videoCount == ENCODEQUEUE) {
+			pthread_cond_wait(&encodeRoom, &encodeMutex);
+		}
+		// the pixels are handed over, not copied
+		videoQueue[(videoHead + videoCount) % ENCODEQUEUE] = *c;
+		videoCount++;
+		pthread_cond_signal(&videoWake);
+		pthread_mutex_unlock(&encodeMutex);
+		return;
+	}
+	while (encodeCount == ENCODEQUEUE) {
+		pthread_cond_wait(&encodeRoom, &encodeMutex);
+	}
+	encodeQueue[(encodeHead + encodeCount) % ENCODEQUEUE] = *c;
+	encodeCount++;
+	pthread_cond_signal(&encodeWake);
+	pthread_mutex_unlock(&encodeMutex);
+}
+
+
+void startEncoders(void) {
+	int i = 0;
+	for (i=0; i<ENCODERS; i++) {
+		if (pthread_create(&encoders[i], NULL, encoderWorker, NULL)) {
+			printf("ERROR: unable to start encoder thread %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if ((video != NULL) && pthread_create(&videoThread, NULL, videoWorker, NULL)) {
+		printf("ERROR: unable to start the video thread\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+void waitEncoders(void) {
+	pthread_mutex_lock(&encodeMutex);
+	while ((encodeCount > 0) || (encodeActive > 0) || (videoCount > 0) || (videoActive > 0)) {
+		pthread_cond_wait(&encodeRoom, &encodeMutex);
+	}
+	pthread_mutex_unlock(&encodeMutex);
 }
 
 
-char* displayObject(objects o, int simple) {
+void closeVideo(void) {
+	if (video != NULL) {
+		fclose(video);
+		video = NULL;
+		printf("INFO: %d frames of %d x %d streamed to %s\n", videoFrames, videoWidth, videoHeight, videoName);
+	}
+}
+
+
+void initCapture(void) {
+	int i = 0;
+	glGenBuffers(CAPTURESLOTS, captureBuffers);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	for (i=0; i<CAPTURESLOTS; i++) {
+		captureIssued[i] = -1;
+	}
+	startEncoders();
+}
+
+
+void collectCapture(int slot) {
+	// the mapping waits for the read back if it has not completed yet
+	capture *c = &captureSlots[slot];
+	size_t size = 3 * (size_t)c->width * c->height;
+	unsigned char *mapped = NULL;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, captureBuffers[slot]);
+	mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (mapped != NULL) {
+		c->pixels = malloc(size);
+		memcpy(c->pixels, mapped, size);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		queueCapture(c);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	captureIssued[slot] = -1;
+}
+
+
+void readCapture(char *name, short verbose) {
+	// starts the read back of the frame drawn in the back buffer
+	int slot = captureNext;
+	capture *c = &captureSlots[slot];
+	if (captureIssued[slot] >= 0) {
+		collectCapture(slot);
+	}
+	c->width = glutGet(GLUT_WINDOW_WIDTH);
+	c->height = glutGet(GLUT_WINDOW_HEIGHT);
+	c->scene = NULL;
+	c->verbose = verbose;
+	snprintf(c->name, sizeof(c->name), "%s", name);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, captureBuffers[slot]);
+	glBufferData(GL_PIXEL_PACK_BUFFER, 3 * (size_t)c->width * c->height, NULL, GL_STREAM_READ);
+	glReadPixels(0, 0, c->width, c->height, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	captureIssued[slot] = captureFrame;
+	captureNext = (slot + 1) % CAPTURESLOTS;
+}
+
+
+void captureDisplay(void) {
+	// called once per frame before the swap
+	int i = 0;
+	char name[32];
+	if (screenshotName[0]) {
+		readCapture(screenshotName, 1);
+		screenshotName[0] = 0;
+	}
+	if (recording) {
+		sprintf(name, "record_%.5d.png", recordCount++);
+		readCapture(name, 0);
+	}
+	for (i=0; i<CAPTURESLOTS; i++) {
+		if ((captureIssued[i] >= 0) && (captureFrame - captureIssued[i] >= CAPTURESLOTS - 1)) {
+			collectCapture(i);
+		}
+	}
+	captureFrame++;
+}
+
+
+void finishCaptures(void) {
+	// hands the pending read backs over and waits for the encoders
+	int i = 0;
+	for (i=0; i<CAPTURESLOTS; i++) {
+		if (captureIssued[i] >= 0) {
+			collectCapture(i);
+		}
+	}
+	waitEncoders();
+	closeVideo();
+}
+
+
+void takeScreenshot(char *filename) {
+	// the next frame is captured once drawn
+	snprintf(screenshotName, sizeof(screenshotName), "%s", filename);
+}
+
+
+void queueScene(void) {
+	// sim thread side of an offscreen frame, only the bodies are copied
+	capture c;
+	particles *p = objectsList;
+	int i = 0;
+	c.scene = malloc(7 * (size_t)sampleSize * sizeof(float));
+	c.count = sampleSize;
+	c.pixels = NULL;
+	c.width = winSizeW;
+	c.height = winSizeH;
+	c.verbose = 0;
+	for (i=0; i<sampleSize; i++) {
+		c.scene[7*i] = p->x[i];
+		c.scene[7*i+1] = p->y[i];
+		c.scene[7*i+2] = p->z[i];
+		c.scene[7*i+3] = p->radius[i];
+		c.scene[7*i+4] = p->color[i].x;
+		c.scene[7*i+5] = p->color[i].y;
+		c.scene[7*i+6] = p->color[i].z;
+	}
+	sprintf(c.name, "frame_%.5d.png", renderCount++);
+	queueCapture(&c);
+}
+
+
+void openTrajectory(void) {
+	trajectory = fopen(trajectoryName, "wb");
+	if (trajectory == NULL) {
+		printf("ERROR: cannot write the trajectory to %s\n", trajectoryName);
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+void putLittle(unsigned char *b, uint64_t v, int n) {
+	int i = 0;
+	for (i=0; i<n; i++) {
+		b[i] = (v >> (8 * i)) & 0xff;
+	}
+}
+
+
+uint64_t getLittle(unsigned char *b, int n) {
+	uint64_t v = 0;
+	int i = 0;
+	for (i=n-1; i>=0; i--) {
+		v = (v << 8) | b[i];
+	}
+	return(v);
+}
+
+
+void packTrajectoryHeader(trajectoryHeader *h, unsigned char *b) {
+	uint64_t bits = 0;
+	memcpy(b, h->magic, 8);
+	putLittle(&b[8], h->version, 4);
+	putLittle(&b[12], h->bodies, 4);
+	putLittle(&b[16], h->chunkSteps, 4);
+	putLittle(&b[20], h->columns, 4);
+	memcpy(&bits, &h->positionQuantum, 8);
+	putLittle(&b[24], bits, 8);
+	memcpy(&bits, &h->velocityQuantum, 8);
+	putLittle(&b[32], bits, 8);
+}
+
+
+void unpackTrajectoryHeader(unsigned char *b, trajectoryHeader *h) {
+	uint64_t bits = 0;
+	memcpy(h->magic, b, 8);
+	h->version = getLittle(&b[8], 4);
+	h->bodies = getLittle(&b[12], 4);
+	h->chunkSteps = getLittle(&b[16], 4);
+	h->columns = getLittle(&b[20], 4);
+	bits = getLittle(&b[24], 8);
+	memcpy(&h->positionQuantum, &bits, 8);
+	bits = getLittle(&b[32], 8);
+	memcpy(&h->velocityQuantum, &bits, 8);
+}
+
+
+void packTrajectoryChunk(trajectoryChunk *chunk, unsigned char *b) {
+	int c = 0;
+	putLittle(b, chunk->firstStep, 8);
+	putLittle(&b[8], chunk->steps, 4);
+	putLittle(&b[12], 0, 4);
+	for (c=0; c<6; c++) {
+		putLittle(&b[16+8*c], chunk->size[c], 8);
+	}
+}
+
+
+void unpackTrajectoryChunk(unsigned char *b, trajectoryChunk *chunk) {
+	int c = 0;
+	chunk->firstStep = getLittle(b, 8);
+	chunk->steps = getLittle(&b[8], 4);
+	chunk->reserved = 0;
+	for (c=0; c<6; c++) {
+		chunk->size[c] = getLittle(&b[16+8*c], 8);
+	}
+}
+
+
+void deflateColumn(z_stream *z, unsigned char *data, size_t size, int flush, unsigned char **out, size_t *capacity) {
+	// appends to the compressed column, the buffer grows as needed
+	z->next_in = data;
+	z->avail_in = size;
+	do {
+		if (z->total_out + 65536 > *capacity) {
+			*capacity = 2 * *capacity + 65536;
+			*out = realloc(*out, *capacity);
+		}
+		z->next_out = *out + z->total_out;
+		z->avail_out = *capacity - z->total_out;
+	} while ((deflate(z, flush) != Z_STREAM_END) && ((z->avail_in > 0) || (z->avail_out == 0) || (flush == Z_FINISH)));
+}
+
+
+void writeTrajectoryChunk(z_stream *z, unsigned char **out, size_t *capacity, long firstStep, int steps) {
+	trajectoryChunk chunk;
+	unsigned char b[TRAJECTORYBLOCK];
+	int c = 0;
+	memset(&chunk, 0, sizeof(chunk));
+	chunk.firstStep = firstStep;
+	chunk.steps = steps;
+	for (c=0; c<6; c++) {
+		deflateColumn(&z[c], NULL, 0, Z_FINISH, &out[c], &capacity[c]);
+		chunk.size[c] = z[c].total_out;
+	}
+	packTrajectoryChunk(&chunk, b);
+	fwrite(b, 1, TRAJECTORYBLOCK, trajectory);
+	trajectoryBytes += TRAJECTORYBLOCK;
+	for (c=0; c<6; c++) {
+		fwrite(out[c], 1, chunk.size[c], trajectory);
+		trajectoryBytes += chunk.size[c];
+		deflateReset(&z[c]);
+	}
+	fflush(trajectory);
+}
+
+
+void *trajectoryWorker(void *arg) {
+	// background writer: quantizes, predicts and compresses the queued steps
+	z_stream z[6];
+	unsigned char *out[6],
+		*varints = malloc(10 * (size_t)sampleSize),
+		*v = NULL;
+	size_t capacity[6];
+	long *previous = alignedArray(6 * sampleSize, sizeof(long)),
+		*last = NULL,
+		q = 0,
+		r = 0,
+		firstStep = 0;
+	unsigned long zigzag = 0;
+	double *column = NULL,
+		scale = 0.0;
+	int c = 0,
+		i = 0,
+		k = 0,
+		slot = 0,
+		steps = 0;
+	(void)arg;
+	for (c=0; c<6; c++) {
+		memset(&z[c], 0, sizeof(z_stream));
+		deflateInit(&z[c], 1);
+		out[c] = NULL;
+		capacity[c] = 0;
+	}
+	for (;;) {
+		pthread_mutex_lock(&trajectoryMutex);
+		while ((trajectoryCount == 0) && !trajectoryClosing) {
+			pthread_cond_wait(&trajectoryWake, &trajectoryMutex);
+		}
+		if (trajectoryCount == 0) {
+			pthread_mutex_unlock(&trajectoryMutex);
+			break;
+		}
+		slot = trajectoryHead;
+		pthread_mutex_unlock(&trajectoryMutex);
+		if (steps == 0) {
+			firstStep = trajectoryStep[slot];
+		}
+		// velocities first, the positions are predicted with the current ones
+		for (k=0; k<6; k++) {
+			c = (k + 3) % 6;
+			column = trajectoryColumns[slot][c];
+			last = &previous[(size_t)c * sampleSize];
+			scale = ldexp(1.0, (c < 3) ? 10 : 10 + TRAJECTORYSHIFT);
+			v = varints;
+			for (i=0; i<sampleSize; i++) {
+				q = llround(column[i] * scale);
+				r = q;
+				if (steps > 0) {
+					r -= last[i];
+					if (c < 3) {
+						r -= (previous[(size_t)(c + 3) * sampleSize + i] + (1 << (TRAJECTORYSHIFT - 1))) >> TRAJECTORYSHIFT;
+					}
+				}
+				last[i] = q;
+				zigzag = ((unsigned long)r << 1) ^ (unsigned long)(r >> 63);
+				while (zigzag >= 0x80) {
+					*v++ = (zigzag & 0x7f) | 0x80;
+					zigzag >>= 7;
+				}
+				*v++ = zigzag;
+			}
+			deflateColumn(&z[c], varints, v - varints, Z_NO_FLUSH, &out[c], &capacity[c]);
+		}
+		pthread_mutex_lock(&trajectoryMutex);
+		trajectoryHead = (trajectoryHead + 1) % TRAJECTORYQUEUE;
+		trajectoryCount--;
+		pthread_cond_signal(&trajectoryRoom);
+		pthread_mutex_unlock(&trajectoryMutex);
+		trajectoryWritten++;
+		if (++steps == TRAJECTORYCHUNK) {
+			writeTrajectoryChunk(z, out, capacity, firstStep, steps);
+			steps = 0;
+		}
+	}
+	if (steps > 0) {
+		writeTrajectoryChunk(z, out, capacity, firstStep, steps);
+	}
+	for (c=0; c<6; c++) {
+		deflateEnd(&z[c]);
+		free(out[c]);
+	}
+	free(varints);
+	return(NULL);
+}
+
+
+void queueTrajectory(void) {
+	// sim thread side, the step is only copied
+	double *columns[6] = {objectsList->x, objectsList->y, objectsList->z, objectsList->vx, objectsList->vy, objectsList->vz};
+	int c = 0,
+		slot = 0;
+	pthread_mutex_lock(&trajectoryMutex);
+	while ((trajectoryCount == TRAJECTORYQUEUE) && !trajectoryClosing) {
+		pthread_cond_wait(&trajectoryRoom, &trajectoryMutex);
+	}
+	if (trajectoryClosing) {
+		pthread_mutex_unlock(&trajectoryMutex);
+		return;
+	}
+	slot = (trajectoryHead + trajectoryCount) % TRAJECTORYQUEUE;
+	pthread_mutex_unlock(&trajectoryMutex);
+	// the writer does not read a slot before it is counted
+	for (c=0; c<6; c++) {
+		memcpy(trajectoryColumns[slot][c], columns[c], sampleSize * sizeof(double));
+	}
+	trajectoryStep[slot] = stepCount;
+	pthread_mutex_lock(&trajectoryMutex);
+	trajectoryCount++;
+	pthread_cond_signal(&trajectoryWake);
+	pthread_mutex_unlock(&trajectoryMutex);
+}
+
+
+void startTrajectory(void) {
+	// writes the header and the current step, called once the bodies are set
+	trajectoryHeader h;
+	unsigned char b[TRAJECTORYHEADER];
+	int c = 0,
+		i = 0;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "TRAJECTO", 8);
+	h.version = TRAJECTORYVERSION;
+	h.bodies = sampleSize;
+	h.chunkSteps = TRAJECTORYCHUNK;
+	h.columns = 6;
+	h.positionQuantum = ldexp(1.0, -10);
+	h.velocityQuantum = ldexp(1.0, -10 - TRAJECTORYSHIFT);
+	packTrajectoryHeader(&h, b);
+	fwrite(b, 1, TRAJECTORYHEADER, trajectory);
+	trajectoryBytes = TRAJECTORYHEADER;
+	for (i=0; i<TRAJECTORYQUEUE; i++) {
+		for (c=0; c<6; c++) {
+			trajectoryColumns[i][c] = alignedArray(sampleSize, sizeof(double));
+		}
+	}
+	if (pthread_create(&trajectoryThread, NULL, trajectoryWorker, NULL)) {
+		printf("ERROR: unable to start the trajectory thread\n");
+		exit(EXIT_FAILURE);
+	}
+	queueTrajectory();
+}
+
+
+void finishTrajectory(void) {
+	// the queued steps are written, later ones are dropped
+	pthread_mutex_lock(&trajectoryMutex);
+	trajectoryClosing = 1;
+	pthread_cond_broadcast(&trajectoryWake);
+	pthread_cond_broadcast(&trajectoryRoom);
+	pthread_mutex_unlock(&trajectoryMutex);
+	pthread_join(trajectoryThread, NULL);
+	fclose(trajectory);
+	trajectory = NULL;
+	printf("INFO: %d steps written to %s, %.2f bytes per body and step\n", trajectoryWritten, trajectoryName, (double)trajectoryBytes / ((double)trajectoryWritten * sampleSize));
+}
+
+
+unsigned char *inflateColumn(unsigned char *in, size_t size, size_t *outSize) {
+	z_stream z;
+	unsigned char *out = NULL;
+	size_t capacity = 0;
+	int status = Z_OK;
+	memset(&z, 0, sizeof(z));
+	inflateInit(&z);
+	z.next_in = in;
+	z.avail_in = size;
+	while (status == Z_OK) {
+		if (z.total_out + 65536 > capacity) {
+			capacity = 2 * capacity + 65536;
+			out = realloc(out, capacity);
+		}
+		z.next_out = out + z.total_out;
+		z.avail_out = capacity - z.total_out;
+		status = inflate(&z, Z_NO_FLUSH);
+	}
+	*outSize = z.total_out;
+	inflateEnd(&z);
+	if (status != Z_STREAM_END) {
+		free(out);
+		return(NULL);
+	}
+	return(out);
+}
+
+
+FILE *openTrajectoryFile(char *name, trajectoryHeader *h) {
+	unsigned char b[TRAJECTORYHEADER];
+	FILE *fp = fopen(name, "rb");
+	if ((fp == NULL) || (fread(b, 1, TRAJECTORYHEADER, fp) != TRAJECTORYHEADER)) {
+		printf("ERROR: cannot read the trajectory %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+	unpackTrajectoryHeader(b, h);
+	if (memcmp(h->magic, "TRAJECTO", 8) || (h->version != TRAJECTORYVERSION) || (h->columns != 6)) {
+		printf("ERROR: %s is not a trajectory of version %d\n", name, TRAJECTORYVERSION);
+		exit(EXIT_FAILURE);
+	}
+	return(fp);
+}
+
+
+int readTrajectoryChunk(FILE *fp, trajectoryHeader *h, long *current, int mode) {
+	// mode 0 skips the block, 1 decodes it into current, the quantized last
+	// step, and 2 also prints every step; returns the steps of the block, 0
+	// at the end of the file and -1 for a damaged block
+	trajectoryChunk chunk;
+	unsigned char b[TRAJECTORYBLOCK],
+		*packed = NULL,
+		*column[6],
+		*cursor[6],
+		*end[6];
+	size_t size = 0;
+	long q = 0,
+		skip = 0,
+		*last = NULL;
+	uint64_t zigzag = 0;
+	int c = 0,
+		i = 0,
+		k = 0,
+		s = 0,
+		shift = 0,
+		ok = 1,
+		n = h->bodies;
+	if (fread(b, 1, TRAJECTORYBLOCK, fp) != TRAJECTORYBLOCK) {
+		return(0);
+	}
+	unpackTrajectoryChunk(b, &chunk);
+	if (mode == 0) {
+		for (c=0; c<6; c++) {
+			skip += chunk.size[c];
+		}
+		return(fseek(fp, skip, SEEK_CUR) == 0 ? chunk.steps : -1);
+	}
+	for (c=0; c<6; c++) {
+		packed = malloc(chunk.size[c]);
+		column[c] = NULL;
+		size = 0;
+		if (fread(packed, 1, chunk.size[c], fp) == (size_t)chunk.size[c]) {
+			column[c] = inflateColumn(packed, chunk.size[c], &size);
+		}
+		free(packed);
+		ok &= (column[c] != NULL);
+		cursor[c] = column[c];
+		end[c] = column[c] + size;
+	}
+	for (s=0; ok && (s<chunk.steps); s++) {
+		// velocities first, the positions are predicted with the current ones
+		for (k=0; ok && (k<6); k++) {
+			c = (k + 3) % 6;
+			last = &current[(size_t)c * n];
+			for (i=0; i<n; i++) {
+				zigzag = 0;
+				shift = 0;
+				do {
+					if ((cursor[c] == end[c]) || (shift > 63)) {
+						ok = 0;
+						break;
+					}
+					zigzag |= (uint64_t)(*cursor[c] & 0x7f) << shift;
+					shift += 7;
+				} while (*cursor[c]++ & 0x80);
+				q = (long)(zigzag >> 1) ^ -(long)(zigzag & 1);
+				if (s > 0) {
+					q += last[i];
+					if (c < 3) {
+						q += (current[(size_t)(c + 3) * n + i] + (1 << (TRAJECTORYSHIFT - 1))) >> TRAJECTORYSHIFT;
+					}
+				}
+				last[i] = q;
+			}
+		}
+		for (i=0; ok && (mode == 2) && (i<n); i++) {
+			fprintf(dumpOutput, "%ld %d %.17g %.17g %.17g %.17g %.17g %.17g\n", chunk.firstStep + s, i,
+				current[i] * h->positionQuantum, current[n+i] * h->positionQuantum, current[2*n+i] * h->positionQuantum,
+				current[3*n+i] * h->velocityQuantum, current[4*n+i] * h->velocityQuantum, current[5*n+i] * h->velocityQuantum);
+		}
+	}
+	for (c=0; c<6; c++) {
+		ok &= (cursor[c] == end[c]);
+		free(column[c]);
+	}
+	return(ok ? chunk.steps : -1);
+}
+
+
+void dumpTrajectory(void) {
+	// -X prints every step of a trajectory as text, one body per line
+	trajectoryHeader h;
+	FILE *fp = openTrajectoryFile(dumpName, &h);
+	long *current = malloc(6 * (size_t)h.bodies * sizeof(long)),
+		steps = 0;
+	int n = 0;
+	fprintf(dumpOutput, "# step body x y z vx vy vz\n");
+	while ((n = readTrajectoryChunk(fp, &h, current, 2)) > 0) {
+		steps += n;
+	}
+	fclose(fp);
+	fclose(dumpOutput);
+	if (n < 0) {
+		printf("ERROR: damaged block after step %ld of %s\n", steps, dumpName);
+		exit(EXIT_FAILURE);
+	}
+	printf("INFO: %ld steps of %d bodies read from %s\n", steps, h.bodies, dumpName);
+}
+
+
+void checkTrajectory(void) {
+	// the batch mode reads its last block back and compares it with the state
+	trajectoryHeader h;
+	FILE *fp = openTrajectoryFile(trajectoryName, &h);
+	double *columns[6] = {objectsList->x, objectsList->y, objectsList->z, objectsList->vx, objectsList->vy, objectsList->vz};
+	double error[2] = {0.0, 0.0};
+	long *current = malloc(6 * (size_t)sampleSize * sizeof(long)),
+		offset = ftell(fp),
+		lastOffset = offset;
+	int c = 0,
+		i = 0,
+		n = 0;
+	while ((n = readTrajectoryChunk(fp, &h, current, 0)) > 0) {
+		lastOffset = offset;
+		offset = ftell(fp);
+	}
+	fseek(fp, lastOffset, SEEK_SET);
+	if ((n < 0) || (h.bodies != sampleSize) || (readTrajectoryChunk(fp, &h, current, 1) <= 0)) {
+		printf("ERROR: %s cannot be read back\n", trajectoryName);
+		exit(EXIT_FAILURE);
+	}
+	for (c=0; c<6; c++) {
+		for (i=0; i<sampleSize; i++) {
+			error[c >= 3] = fmax(error[c >= 3], fabs(current[(size_t)c * sampleSize + i] * ((c < 3) ? h.positionQuantum : h.velocityQuantum) - columns[c][i]));
+		}
+	}
+	printf("INFO: last step read back from %s within %g of the positions and %g of the velocities\n", trajectoryName, error[0], error[1]);
+	free(current);
+	fclose(fp);
+}
+
+
+void openDump(char *name) {
+	// the text goes to the standard output, messages to stderr
+	dumpName = name;
+	dumpOutput = fdopen(dup(STDOUT_FILENO), "w");
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+}
+
+
+char* displayObject(int o, int simple) {
 	char *text = NULL;
+	snapshot *p = view;
 	text = calloc(120, sizeof(text));
 	if (simple) {
-		sprintf(text, "[%d] coord: (%.2f, %.2f, %.2f)", o.id, o.pos.x, o.pos.y, o.pos.z);
+		sprintf(text, "[%d] coord: (%.2f, %.2f, %.2f)", o, p->x[o], p->y[o], p->z[o]);
 	} else {
-		sprintf(text, "[%d] coord: (%.2f, %.2f, %.2f) velocity: (%.2f, %.2f, %.2f)\n", o.id, o.pos.x, o.pos.y, o.pos.z, o.velocity.x, o.velocity.y, o.velocity.z);
+		sprintf(text, "[%d] coord: (%.2f, %.2f, %.2f) velocity: (%.2f, %.2f, %.2f)\n", o, p->x[o], p->y[o], p->z[o], p->vx[o], p->vy[o], p->vz[o]);
 	}
 	return(text);
 }
 
 
-void drawObject(objects o, int name) {
+GLuint compileShader(GLenum type, const char *source) {
+	GLuint shader = glCreateShader(type);
+	GLint status = 0;
+	char log[512];
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (!status) {
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		printf("INFO: sphere shader rejected: %s\n", log);
+		glDeleteShader(shader);
+		return(0);
+	}
+	return(shader);
+}
+
+
+void initSpheres(void) {
+	int st=0, sl=0, n=0;
+	double theta=0.0, phi=0.0;
+	float *vertices = NULL;
+	GLuint *indices = NULL,
+		vertex = 0,
+		fragment = 0;
+	GLint status = 0;
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+	sphereList = glGenLists(1);
+	glNewList(sphereList, GL_COMPILE);
+	glutSolidSphere(1.0, SPHERESTEPS, SPHERESTEPS);
+	glEndList();
+	if ((extensions == NULL) || !strstr(extensions, "GL_ARB_instanced_arrays") || !strstr(extensions, "GL_ARB_draw_instanced") || !strstr(extensions, "GL_ARB_shading_language_100")) {
+		printf("INFO: instancing unavailable, spheres are drawn one by one\n");
+		return;
+	}
+	vertex = compileShader(GL_VERTEX_SHADER, sphereVertexShader);
+	fragment = compileShader(GL_FRAGMENT_SHADER, sphereFragmentShader);
+	if (!vertex || !fragment) {
+		return;
+	}
+	sphereProgram = glCreateProgram();
+	glAttachShader(sphereProgram, vertex);
+	glAttachShader(sphereProgram, fragment);
+	glLinkProgram(sphereProgram);
+	glGetProgramiv(sphereProgram, GL_LINK_STATUS, &status);
+	if (!status) {
+		printf("INFO: sphere program rejected, spheres are drawn one by one\n");
+		glDeleteProgram(sphereProgram);
+		sphereProgram = 0;
+		return;
+	}
+	sphereVertex = glGetAttribLocation(sphereProgram, "vertex");
+	sphereInstance = glGetAttribLocation(sphereProgram, "instance");
+	sphereTint = glGetAttribLocation(sphereProgram, "tint");
+
+	// unit sphere by stacks from the +z pole, triangles wound counterclockwise seen from outside
+	vertices = calloc(3 * (SPHERESTEPS + 1) * (SPHERESTEPS + 1), sizeof(float));
+	indices = calloc(6 * SPHERESTEPS * SPHERESTEPS, sizeof(GLuint));
+	for (st=0; st<=SPHERESTEPS; st++) {
+		theta = pi * st / SPHERESTEPS;
+		for (sl=0; sl<=SPHERESTEPS; sl++) {
+			phi = 2.0 * pi * sl / SPHERESTEPS;
+			n = 3 * (st * (SPHERESTEPS + 1) + sl);
+			vertices[n] = sin(theta) * cos(phi);
+			vertices[n+1] = sin(theta) * sin(phi);
+			vertices[n+2] = cos(theta);
+		}
+	}
+	for (st=0; st<SPHERESTEPS; st++) {
+		for (sl=0; sl<SPHERESTEPS; sl++) {
+			n = st * (SPHERESTEPS + 1) + sl;
+			indices[sphereIndices++] = n;
+			indices[sphereIndices++] = n + SPHERESTEPS + 1;
+			indices[sphereIndices++] = n + 1;
+			indices[sphereIndices++] = n + 1;
+			indices[sphereIndices++] = n + SPHERESTEPS + 1;
+			indices[sphereIndices++] = n + SPHERESTEPS + 2;
+		}
+	}
+	glGenBuffers(3, sphereBuffers);
+	glBindBuffer(GL_ARRAY_BUFFER, sphereBuffers[0]);
+	glBufferData(GL_ARRAY_BUFFER, 3 * (SPHERESTEPS + 1) * (SPHERESTEPS + 1) * sizeof(float), vertices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sphereBuffers[1]);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sphereIndices * sizeof(GLuint), indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	free(vertices);
+	free(indices);
+	instanceData = alignedArray(7 * sampleSize, sizeof(float));
+	printf("INFO: spheres drawn with instancing\n");
+}
+
+
+void drawObject(int o) {
 	glPushMatrix();
-	glTranslatef(o.pos.x, o.pos.y, o.pos.z);
-	if (o.selected) {
+	glTranslatef(view->x[o], view->y[o], view->z[o]);
+	if (view->selected[o]) {
 		glColor3f(1.0, 0.0, 0.0);
-		glutWireCube(o.radius * 2.0);
+		glutWireCube(view->radius[o] * 2.0);
 	}
-	glColor3f(o.color.x, o.color.y, o.color.z);
-	glLoadName(name);
-	glutSolidSphere(o.radius, 12, 12);
+	glColor3f(view->color[o].x, view->color[o].y, view->color[o].z);
+	glScalef(view->radius[o], view->radius[o], view->radius[o]);
+	glCallList(sphereList);
 	glPopMatrix();
 }
 
 
-void drawPath(objects o) {
+void drawSpheres(void) {
+	// one instanced draw for all the bodies
 	int i = 0;
+	float *d = NULL;
+	if (!sphereProgram) {
+		for (i=0; i<sampleSize; i++) {
+			drawObject(i);
+		}
+		return;
+	}
+	for (i=0; i<sampleSize; i++) {
+		d = &instanceData[7*i];
+		d[0] = view->x[i]; d[1] = view->y[i]; d[2] = view->z[i];
+		d[3] = view->radius[i];
+		d[4] = view->color[i].x; d[5] = view->color[i].y; d[6] = view->color[i].z;
+	}
+	glUseProgram(sphereProgram);
+	glBindBuffer(GL_ARRAY_BUFFER, sphereBuffers[0]);
+	glEnableVertexAttribArray(sphereVertex);
+	glVertexAttribPointer(sphereVertex, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+	glBindBuffer(GL_ARRAY_BUFFER, sphereBuffers[2]);
+	// orphaning the store lets the driver keep drawing the previous frame
+	glBufferData(GL_ARRAY_BUFFER, 7 * sampleSize * sizeof(float), NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, 7 * sampleSize * sizeof(float), instanceData);
+	glEnableVertexAttribArray(sphereInstance);
+	glVertexAttribPointer(sphereInstance, 4, GL_FLOAT, GL_FALSE, 7 * sizeof(float), NULL);
+	glVertexAttribDivisorARB(sphereInstance, 1);
+	glEnableVertexAttribArray(sphereTint);
+	glVertexAttribPointer(sphereTint, 3, GL_FLOAT, GL_FALSE, 7 * sizeof(float), (void *)(4 * sizeof(float)));
+	glVertexAttribDivisorARB(sphereTint, 1);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sphereBuffers[1]);
+	glDrawElementsInstancedARB(GL_TRIANGLES, sphereIndices, GL_UNSIGNED_INT, NULL, sampleSize);
+	glVertexAttribDivisorARB(sphereInstance, 0);
+	glVertexAttribDivisorARB(sphereTint, 0);
+	glDisableVertexAttribArray(sphereVertex);
+	glDisableVertexAttribArray(sphereInstance);
+	glDisableVertexAttribArray(sphereTint);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glUseProgram(0);
+	for (i=0; i<sampleSize; i++) {
+		if (view->selected[i]) {
+			glPushMatrix();
+			glTranslatef(view->x[i], view->y[i], view->z[i]);
+			glColor3f(1.0, 0.0, 0.0);
+			glutWireCube(view->radius[i] * 2.0);
+			glPopMatrix();
+		}
+	}
+}
+
+
+void initTrails(void) {
+	int o = 0,
+		s = 0;
+	size_t n = 0;
+	GLuint *indices = calloc((size_t)maxPathLength * sampleSize, sizeof(GLuint));
+	for (o=0; o<sampleSize; o++) {
+		for (s=0; s<maxPathLength; s++) {
+			indices[n++] = s * sampleSize + o;
+		}
+	}
+	glGenBuffers(3, trailBuffers);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, trailBuffers[2]);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, n * sizeof(GLuint), indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	free(indices);
+	glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[0]);
+	glBufferData(GL_ARRAY_BUFFER, 3 * (size_t)maxPathLength * sampleSize * sizeof(float), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[1]);
+	glBufferData(GL_ARRAY_BUFFER, 3 * (size_t)maxPathLength * sampleSize, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	trailColors = alignedArray(3 * sampleSize, sizeof(unsigned char));
+}
+
+
+void updateTrails(void) {
+	// called every frame after the snapshot is taken, it holds the points of
+	// the steps after trailSteps and they are sent from there
+	int i = 0,
+		s = 0,
+		slot = 0,
+		fresh = view->steps - trailSteps < view->pathLength ? view->steps - trailSteps : view->pathLength;
+	size_t size = 3 * (size_t)sampleSize;
+	if (fresh > view->steps - view->trailFirst + 1) {
+		fresh = view->steps - view->trailFirst + 1;
+	}
+	if (fresh <= 0) {
+		return;
+	}
+	for (i=0; i<sampleSize; i++) {
+		trailColors[3*i] = (unsigned char)(255.0 * fmin(fmax(view->color[i].x, 0.0), 1.0));
+		trailColors[3*i+1] = (unsigned char)(255.0 * fmin(fmax(view->color[i].y, 0.0), 1.0));
+		trailColors[3*i+2] = (unsigned char)(255.0 * fmin(fmax(view->color[i].z, 0.0), 1.0));
+	}
+	for (s=0; s<fresh; s++) {
+		slot = (view->pathHead - s + maxPathLength) % maxPathLength;
+		glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[0]);
+		glBufferSubData(GL_ARRAY_BUFFER, slot * size * sizeof(float), size * sizeof(float), &view->trail[slot * size]);
+		glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[1]);
+		glBufferSubData(GL_ARRAY_BUFFER, slot * size, size, trailColors);
+	}
+	trailSteps = view->steps;
+	atomic_store(&trailShown, trailSteps);
+}
+
+
+void drawTrails(void) {
+	// filled slots are contiguous until the ring is full, one draw covers them
+	int first = view->pathHead - view->pathLength + 1;
 	glPointSize(0.5f);
-	glColor3f(o.color.x, o.color.y, o.color.z);
-	for (i=0; i<maxPathLength; i++) {
-		glBegin(GL_POINTS);
-			glNormal3f(o.path[i].x, o.path[i].y, o.path[i].z);
-			glVertex3f(o.path[i].x, o.path[i].y, o.path[i].z);
-		glEnd();
+	glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[0]);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, NULL);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glNormalPointer(GL_FLOAT, 0, NULL);
+	glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[1]);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glColorPointer(3, GL_UNSIGNED_BYTE, 0, NULL);
+	if (view->pathLength < maxPathLength) {
+		glDrawArrays(GL_POINTS, first * sampleSize, view->pathLength * sampleSize);
+	} else {
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, trailBuffers[2]);
+		glDrawElements(GL_POINTS, maxPathLength * sampleSize, GL_UNSIGNED_INT, NULL);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 	}
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+void drawPath(int o) {
+	// the uploaded points of one body, contiguous in the body-major indices
+	// since the ring is filled from slot 0
+	glPointSize(0.5f);
+	glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[0]);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, NULL);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glNormalPointer(GL_FLOAT, 0, NULL);
+	glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[1]);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glColorPointer(3, GL_UNSIGNED_BYTE, 0, NULL);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, trailBuffers[2]);
+	glDrawElements(GL_POINTS, view->pathLength, GL_UNSIGNED_INT, (GLvoid *)((size_t)o * maxPathLength * sizeof(GLuint)));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
 
@@ -293,10 +1773,10 @@ void drawText(void) {
 	int i = 0;
 	char text1[50], text2[70], text3[120];
 	sprintf(text1, "Nbr of objects: %d", sampleSize);
-	sprintf(text2, "dt: %1.3f, FPS: %4.2f", (dt/1000.0), fps);
+	sprintf(text2, "steps/s: %.1f, FPS: %4.2f", stepRate, fps);
 	for (i=0; i<sampleSize; i++) {
-		if (objectsList[i].selected) {
-			sprintf(text3, "%s", displayObject(objectsList[i], 0));
+		if (view->selected[i]) {
+			sprintf(text3, "%s", displayObject(i, 0));
 		}
 	}
 	textList = glGenLists(1);
@@ -318,8 +1798,35 @@ void drawAxes(void) {
 }
 
 
+void drawBox(void) {
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	gluOrtho2D(0, pickPort[2], 0, pickPort[3]);
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadIdentity();
+	glDisable(GL_LIGHTING);
+	glDisable(GL_DEPTH_TEST);
+	glColor3f(1.0, 0.0, 0.0);
+	glBegin(GL_LINE_LOOP);
+	glVertex2i(boxX0, boxY0);
+	glVertex2i(boxX1, boxY0);
+	glVertex2i(boxX1, boxY1);
+	glVertex2i(boxX0, boxY1);
+	glEnd();
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_LIGHTING);
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+}
+
+
 void display(void) {
 	int i=0;
+	acquireSnapshot();
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
@@ -332,6 +1839,9 @@ void display(void) {
 	glRotatef(rotx, 1.0, 0.0, 0.0);
 	glRotatef(roty, 0.0, 1.0, 0.0);
 	glRotatef(rotz, 0.0, 0.0, 1.0);
+	glGetDoublev(GL_MODELVIEW_MATRIX, pickModel);
+	glGetDoublev(GL_PROJECTION_MATRIX, pickProjection);
+	glGetIntegerv(GL_VIEWPORT, pickPort);
 
 	GLfloat ambient1[] = {0.15f, 0.15f, 0.15f, 1.0f};
 	GLfloat diffuse1[] = {0.8f, 0.8f, 0.8f, 1.0f};
@@ -344,61 +1854,220 @@ void display(void) {
 	glEnable(GL_LIGHT1);
 
 	if (axe) { drawAxes(); }
-	for (i=0; i<sampleSize; i++) {
-		drawObject(objectsList[i], i);
-		if (trace) {
-			if (objectsList[i].selected) {
-				drawPath(objectsList[i]);
+	drawSpheres();
+	updateTrails();
+	if (allTraces) {
+		drawTrails();
+	} else if (trace) {
+		for (i=0; i<sampleSize; i++) {
+			if (view->selected[i]) {
+				drawPath(i);
 			}
 		}
-		if (allTraces) {
-			drawPath(objectsList[i]);
-		}
 	}
 	glPopMatrix();
+	if (boxActive) {
+		drawBox();
+	}
+	captureDisplay();
 
 	glutSwapBuffers();
 	glutPostRedisplay();
 }
 
 
-void processSelectedObject(GLint hitsNumber, GLuint *selectBuffer) {
-	int objectName = 0;
-	if (hitsNumber == 1) {
-		objectName = selectBuffer[3];
-		objectsList[objectName].selected = !objectsList[objectName].selected;
-		printf("INFO: Touched -> %s", displayObject(objectsList[objectName], 1));
+void pickSelect(int first, int last, int nth, double *c) {
+	// reorders pickIndex so that nth holds the median along c of the range
+	int i=0, j=0, t=0;
+	double pivot = 0.0;
+	while (last - first > 1) {
+		pivot = c[pickIndex[(first + last) / 2]];
+		i = first;
+		j = last - 1;
+		while (i <= j) {
+			while (c[pickIndex[i]] < pivot) {
+				i++;
+			}
+			while (c[pickIndex[j]] > pivot) {
+				j--;
+			}
+			if (i <= j) {
+				t = pickIndex[i]; pickIndex[i] = pickIndex[j]; pickIndex[j] = t;
+				i++;
+				j--;
+			}
+		}
+		if (nth <= j) {
+			last = j + 1;
+		} else if (nth >= i) {
+			first = i;
+		} else {
+			return;
+		}
+	}
+}
+
+
+void pickBuild(int node, int first, int last) {
+	// splits at the median center of the widest axis, the boxes bound the
+	// spheres of the leaves and are merged on the way up
+	int i=0, a=0, axis=0, o=0,
+		left = 2 * node + 1,
+		right = 2 * node + 2;
+	double *c[3] = {view->x, view->y, view->z},
+		*lo = &pickLo[3*node],
+		*hi = &pickHi[3*node],
+		low[3], high[3];
+	pickFirst[node] = first;
+	pickLast[node] = last;
+	if (last - first <= PICKLEAF) {
+		for (a=0; a<3; a++) {
+			lo[a] = HUGE_VAL;
+			hi[a] = -HUGE_VAL;
+			for (i=first; i<last; i++) {
+				o = pickIndex[i];
+				lo[a] = fmin(lo[a], c[a][o] - view->radius[o]);
+				hi[a] = fmax(hi[a], c[a][o] + view->radius[o]);
+			}
+		}
+		return;
+	}
+	for (a=0; a<3; a++) {
+		low[a] = c[a][pickIndex[first]];
+		high[a] = low[a];
+		for (i=first+1; i<last; i++) {
+			o = pickIndex[i];
+			low[a] = c[a][o] < low[a] ? c[a][o] : low[a];
+			high[a] = c[a][o] > high[a] ? c[a][o] : high[a];
+		}
+		if (high[a] - low[a] > high[axis] - low[axis]) {
+			axis = a;
+		}
+	}
+	pickSelect(first, last, (first + last) / 2, c[axis]);
+	pickBuild(left, first, (first + last) / 2);
+	pickBuild(right, (first + last) / 2, last);
+	for (a=0; a<3; a++) {
+		lo[a] = fmin(pickLo[3*left+a], pickLo[3*right+a]);
+		hi[a] = fmax(pickHi[3*left+a], pickHi[3*right+a]);
+	}
+}
+
+
+double pickBox(int node, double *origin, double *inverse) {
+	// distance along the ray to the node box, HUGE_VAL when missed
+	int a = 0;
+	double t0=0.0, t1=0.0, enter=0.0, leave=HUGE_VAL;
+	for (a=0; a<3; a++) {
+		t0 = (pickLo[3*node+a] - origin[a]) * inverse[a];
+		t1 = (pickHi[3*node+a] - origin[a]) * inverse[a];
+		enter = fmax(enter, fmin(t0, t1));
+		leave = fmin(leave, fmax(t0, t1));
 	}
+	return(enter <= leave ? enter : HUGE_VAL);
+}
+
+
+void pickSearch(int node, double *origin, double *dir, double *inverse, double *best, int *hit) {
+	int i=0, o=0;
+	double b=0.0, cc=0.0, disc=0.0, t=0.0, t1=0.0, t2=0.0, oc[3];
+	if (pickLast[node] - pickFirst[node] <= PICKLEAF) {
+		for (i=pickFirst[node]; i<pickLast[node]; i++) {
+			o = pickIndex[i];
+			oc[0] = origin[0] - view->x[o];
+			oc[1] = origin[1] - view->y[o];
+			oc[2] = origin[2] - view->z[o];
+			b = (oc[0] * dir[0]) + (oc[1] * dir[1]) + (oc[2] * dir[2]);
+			cc = (oc[0] * oc[0]) + (oc[1] * oc[1]) + (oc[2] * oc[2]) - (view->radius[o] * view->radius[o]);
+			disc = (b * b) - cc;
+			if (disc >= 0) {
+				t = -b - sqrt(disc);
+				if ((t >= 0) && (t < *best)) {
+					*best = t;
+					*hit = o;
+				}
+			}
+		}
+		return;
+	}
+	t1 = pickBox(2 * node + 1, origin, inverse);
+	t2 = pickBox(2 * node + 2, origin, inverse);
+	if (t1 <= t2) {
+		if (t1 < *best) { pickSearch(2 * node + 1, origin, dir, inverse, best, hit); }
+		if (t2 < *best) { pickSearch(2 * node + 2, origin, dir, inverse, best, hit); }
+	} else {
+		if (t2 < *best) { pickSearch(2 * node + 2, origin, dir, inverse, best, hit); }
+		if (t1 < *best) { pickSearch(2 * node + 1, origin, dir, inverse, best, hit); }
+	}
+}
+
+
+int pickObject(int x, int y) {
+	// nearest sphere under the window point (x, y), -1 when none
+	int i = 0,
+		hit = -1,
+		nodes = 1;
+	double best = HUGE_VAL,
+		length = 0.0,
+		origin[3], end[3], dir[3], inverse[3];
+	if (pickIndex == NULL) {
+		while (PICKLEAF * nodes < sampleSize) {
+			nodes *= 2;
+		}
+		nodes *= 2;
+		pickIndex = alignedArray(sampleSize, sizeof(int));
+		pickFirst = alignedArray(nodes, sizeof(int));
+		pickLast = alignedArray(nodes, sizeof(int));
+		pickLo = alignedArray(3 * nodes, sizeof(double));
+		pickHi = alignedArray(3 * nodes, sizeof(double));
+	}
+	if (pickSteps != view->steps) {
+		for (i=0; i<sampleSize; i++) {
+			pickIndex[i] = i;
+		}
+		pickBuild(0, 0, sampleSize);
+		pickSteps = view->steps;
+	}
+	gluUnProject(x, y, 0.0, pickModel, pickProjection, pickPort, &origin[0], &origin[1], &origin[2]);
+	gluUnProject(x, y, 1.0, pickModel, pickProjection, pickPort, &end[0], &end[1], &end[2]);
+	for (i=0; i<3; i++) {
+		dir[i] = end[i] - origin[i];
+		length += dir[i] * dir[i];
+	}
+	length = sqrt(length);
+	for (i=0; i<3; i++) {
+		dir[i] /= length;
+		inverse[i] = 1.0 / dir[i];
+	}
+	if (pickBox(0, origin, inverse) < best) {
+		pickSearch(0, origin, dir, inverse, &best, &hit);
+	}
+	return(hit);
 }
 
 
 void selectObject(int x, int y) {
-	GLuint selectBuffer[BUFSIZE];
-	GLint hitsNumber;
-	GLint viewPort[4];
+	int o = pickObject(x, y);
+	if (o >= 0) {
+		view->selected[o] = !view->selected[o];
+		printf("INFO: Touched -> %s", displayObject(o, 1));
+	}
+}
 
-	glGetIntegerv(GL_VIEWPORT, viewPort);
-	glSelectBuffer(BUFSIZE, selectBuffer);
-	(void) glRenderMode(GL_SELECT);
-	glInitNames();
-	glPushName(0);
 
-	glMatrixMode(GL_PROJECTION);
-	glPushMatrix();
-	glLoadIdentity();
-	glGetIntegerv(GL_VIEWPORT, viewPort);
-	gluPickMatrix(x, y, 1.0, 1.0, viewPort);
-	gluPerspective(45.0, 1.0, 1.0, 1000.0);
-	glMatrixMode(GL_MODELVIEW);
-	glutSwapBuffers();
-	display();
-	glMatrixMode(GL_PROJECTION);
-	glPopMatrix();
-	glMatrixMode(GL_MODELVIEW);
-	hitsNumber = glRenderMode(GL_RENDER);
-	glFlush();
-	glutPostRedisplay();
-	processSelectedObject(hitsNumber, selectBuffer);
+void selectBox(void) {
+	// selects the objects whose center is drawn inside the dragged box
+	int i = 0,
+		nb = 0;
+	GLdouble wx=0.0, wy=0.0, wz=0.0;
+	for (i=0; i<sampleSize; i++) {
+		gluProject(view->x[i], view->y[i], view->z[i], pickModel, pickProjection, pickPort, &wx, &wy, &wz);
+		if ((wz > 0) && (wz < 1) && (wx >= fmin(boxX0, boxX1)) && (wx <= fmax(boxX0, boxX1)) && (wy >= fmin(boxY0, boxY1)) && (wy <= fmax(boxY0, boxY1))) {
+			view->selected[i] = 1;
+			nb++;
+		}
+	}
+	printf("INFO: %d objects selected in the box\n", nb);
 }
 
 
@@ -439,6 +2108,12 @@ void onSpecial(int key, int x, int y) {
 
 
 void onMotion(int x, int y) {
+	if (boxActive) {
+		boxX1 = x;
+		boxY1 = pickPort[3] - y;
+		glutPostRedisplay();
+		return;
+	}
 	if (prevx) {
 		xx += ((x - prevx)/10.0);
 		printf("INFO: x = %f\n", xx);
@@ -458,6 +2133,8 @@ void onIdle(void) {
 	currentTime = glutGet(GLUT_ELAPSED_TIME);
 	if (currentTime - timebase >= 1000.0){
 		fps = frame*1000.0 / (currentTime-timebase);
+		stepRate = (view->steps - shownSteps) * 1000.0 / (currentTime-timebase);
+		shownSteps = view->steps;
 		timebase = currentTime;
 		frame = 0;
 	}
@@ -470,12 +2147,18 @@ void onMouse(int button, int state, int x, int y) {
 		case GLUT_LEFT_BUTTON:
 			if (state == GLUT_DOWN) {
 				printf("INFO: left button, x %d, y %d\n", x, y);
-				selectObject(x, winSizeH-y);
+				selectObject(x, pickPort[3]-y);
 			}
 			break;
 		case GLUT_RIGHT_BUTTON:
 			if (state == GLUT_DOWN) {
 				printf("INFO: right button, x %d, y %d\n", x, y);
+				boxActive = 1;
+				boxX0 = boxX1 = x;
+				boxY0 = boxY1 = pickPort[3] - y;
+			} else if (boxActive) {
+				selectBox();
+				boxActive = 0;
 			}
 			break;
 	}
@@ -487,6 +2170,11 @@ void onKeyboard(unsigned char key, int x, int y) {
 	switch (key) {
 		case 27: // Escape
 			printf("INFO: exit\n");
+			stopSimulation();
+			finishCaptures();
+			if (trajectory != NULL) {
+				finishTrajectory();
+			}
 			printf("x %d, y %d\n", x, y);
 			exit(0);
 			break;
@@ -549,6 +2237,18 @@ void onKeyboard(unsigned char key, int x, int y) {
 			takeScreenshot(name);
 			cpt += 1;
 			break;
+		case 'c':
+			recording = !recording;
+			if (recording) {
+				if (video != NULL) {
+					printf("INFO: recording every frame to %s\n", videoName);
+				} else {
+					printf("INFO: recording every frame to record_*.png\n");
+				}
+			} else {
+				printf("INFO: %d frames recorded\n", recordCount);
+			}
+			break;
 		default:
 			break;
 	}
@@ -582,9 +2282,9 @@ vector meanColor(int o1) {
 	vector sum;
 	sum.x=0.0; sum.y=0.0; sum.z=0.0;
 	for (o2=0; o2<sampleSize; o2++) {
-		dist = distance(objectsList[o1], objectsList[o2]);
+		dist = distance(objectsList, o1, o2);
 		if ((dist>0) & (dist < minDistance)) {
-			sum = addVec(sum, objectsList[o2].color);
+			sum = addVec(sum, objectsList->color[o2]);
 			numNeighbors++;
 		}
 	}
@@ -592,79 +2292,224 @@ vector meanColor(int o1) {
 		sum = divVecByScalar(sum, numNeighbors);
 		sum = normalize(sum);
 	} else {
-		sum.x = objectsList[o1].color.x;
-		sum.y = objectsList[o1].color.y;
-		sum.z = objectsList[o1].color.z;
+		sum = objectsList->color[o1];
 	}
 	return(sum);
 }
 
 
+double getTime(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return(t.tv_sec + t.tv_nsec * 1.0e-9);
+}
+
+
+void runPoolTasks(void) {
+	// called with poolMutex held
+	int task = 0;
+	while (poolNext < poolTasks) {
+		task = poolNext++;
+		pthread_mutex_unlock(&poolMutex);
+		poolFunc(task);
+		pthread_mutex_lock(&poolMutex);
+		poolFinished++;
+	}
+	if (poolFinished == poolTasks) {
+		pthread_cond_broadcast(&poolDone);
+	}
+}
+
+
+void *poolWorker(void *arg) {
+	int generation = 0;
+	(void)arg;
+	pthread_mutex_lock(&poolMutex);
+	for (;;) {
+		while (generation == poolGeneration) {
+			pthread_cond_wait(&poolWake, &poolMutex);
+		}
+		generation = poolGeneration;
+		runPoolTasks();
+	}
+	return(NULL);
+}
+
+
+void initPool(void) {
+	int i = 0;
+	if (nbThreads < 1) {
+		nbThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (nbThreads < 1) {
+		nbThreads = 1;
+	}
+	workers = calloc(nbThreads, sizeof(pthread_t));
+	for (i=1; i<nbThreads; i++) {
+		if (pthread_create(&workers[i], NULL, poolWorker, NULL)) {
+			printf("ERROR: unable to start worker thread %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+
+void runTasks(int nbTasks, taskFunc func) {
+	pthread_mutex_lock(&poolMutex);
+	poolFunc = func;
+	poolTasks = nbTasks;
+	poolNext = 0;
+	poolFinished = 0;
+	poolGeneration++;
+	pthread_cond_broadcast(&poolWake);
+	runPoolTasks();
+	while (poolFinished < poolTasks) {
+		pthread_cond_wait(&poolDone, &poolMutex);
+	}
+	pthread_mutex_unlock(&poolMutex);
+}
+
+
 void keepWithinBounds(int i) {
 	double highLimit = 150.0,
 		lowLimit = -150.0;
-	if ((objectsList[i].pos.x >= highLimit) | (objectsList[i].pos.x < lowLimit)) {
-		objectsList[i].velocity.x = -1 * objectsList[i].velocity.x;
+	if ((nextList->x[i] >= highLimit) | (nextList->x[i] < lowLimit)) {
+		nextList->vx[i] = -1 * nextList->vx[i];
 	}
-	if ((objectsList[i].pos.y >= highLimit) | (objectsList[i].pos.y < lowLimit)) {
-		objectsList[i].velocity.y = -1 * objectsList[i].velocity.y;
+	if ((nextList->y[i] >= highLimit) | (nextList->y[i] < lowLimit)) {
+		nextList->vy[i] = -1 * nextList->vy[i];
 	}
-	if ((objectsList[i].pos.z >= highLimit) | (objectsList[i].pos.z < lowLimit)) {
-		objectsList[i].velocity.z = -1 * objectsList[i].velocity.z;
+	if ((nextList->z[i] >= highLimit) | (nextList->z[i] < lowLimit)) {
+		nextList->vz[i] = -1 * nextList->vz[i];
 	}
 }
 
 
 void addEltPath(int o1) {
-	int i = 0;
-	vector *temp = calloc(maxPathLength, sizeof(vector));
-
-	if (pathLength < maxPathLength) {
-		objectsList[o1].path[pathLength] = objectsList[o1].pos;
-	} else {
-		for (i=1; i<maxPathLength; i++) {
-			temp[i-1] = objectsList[o1].path[i];
-		}
-		temp[maxPathLength-1] = objectsList[o1].pos;
-		for (i=0; i<maxPathLength; i++) {
-			objectsList[o1].path[i] = temp[i];
-		}
-	}
+	float *point = &pathArena[3 * ((size_t)pathHead * sampleSize + o1)];
+	point[0] = nextList->x[o1];
+	point[1] = nextList->y[o1];
+	point[2] = nextList->z[o1];
 }
 
 
-void update(int value) {
-	int i=0;
+void updateTask(int task) {
+	int i = 0,
+		last = (task + 1) * blockSize < sampleSize ? (task + 1) * blockSize : sampleSize;
 	double dist=0.0,
 		lowLimit=-150.0,
 		groundMass = 0.0;
 	vector acc, diff, ground;
 	groundMass = maxWeight * 100000.0;
-	pathLength ++;
 
-	for (i=0; i<value; i++) {
+	particles *p = objectsList,
+		*n = nextList;
+
+	for (i=task*blockSize; i<last; i++) {
+		n->vx[i] = p->vx[i];
+		n->vy[i] = p->vy[i];
+		n->vz[i] = p->vz[i];
 		acc.x=0.0; acc.y=0.0; acc.z=0.0;
-		ground.x = objectsList[i].pos.x;
-		ground.y = objectsList[i].pos.y;
+		ground.x = p->x[i];
+		ground.y = p->y[i];
 		ground.z = lowLimit;
-		diff = subVec(ground, objectsList[i].pos);
+		diff = subVec(ground, getPos(p, i));
 		if (diff.z < 0) {
 			dist = magnitude(diff);
 			if (dist > 0) {
-				acc.z = (g * objectsList[i].mass * groundMass) / (dist * dist);
+				acc.z = (g * p->mass[i] * groundMass) / (dist * dist);
 				if (acc.z < 1) {
 					acc.z = -acc.z;
-					objectsList[i].velocity = addVec(objectsList[i].velocity, acc);
+					n->vz[i] += acc.z;
 				}
 			}
 		}
-		objectsList[i].pos = addVec(objectsList[i].pos, objectsList[i].velocity);
+		n->x[i] = p->x[i] + n->vx[i];
+		n->y[i] = p->y[i] + n->vy[i];
+		n->z[i] = p->z[i] + n->vz[i];
 
 		keepWithinBounds(i);
 		addEltPath(i);
 	}
-	glutPostRedisplay();
-	glutTimerFunc(dt, update, sampleSize);
+}
+
+
+void step(void) {
+	// one physics step, shared by the window and the batch mode
+	particles *tmp = NULL;
+	// the oldest slot is overwritten once the ring is full
+	pathHead = (pathHead + 1) % maxPathLength;
+	if (pathLength < maxPathLength) {
+		pathLength++;
+	}
+	runTasks((sampleSize + blockSize - 1) / blockSize, updateTask);
+	tmp = objectsList;
+	objectsList = nextList;
+	nextList = tmp;
+}
+
+
+void *simulate(void *arg) {
+	// sim thread of the window, it publishes every step and only waits to
+	// keep stepPeriod between two steps
+	double start = 0.0,
+		wait = 0.0;
+	struct timespec pause;
+	(void)arg;
+	while (!atomic_load(&simStop)) {
+		start = getTime();
+		step();
+		stepCount++;
+		publishSnapshot();
+		if (trajectory != NULL) {
+			queueTrajectory();
+		}
+		wait = stepPeriod - (getTime() - start) * 1000.0;
+		if (wait > 0) {
+			pause.tv_sec = (time_t)(wait / 1000.0);
+			pause.tv_nsec = (long)(fmod(wait, 1000.0) * 1.0e6);
+			nanosleep(&pause, NULL);
+		}
+	}
+	return(NULL);
+}
+
+
+void runBatch(void) {
+	int i = 0;
+	double start = 0.0,
+		elapsed = 0.0;
+	if (renderEvery > 0) {
+		initRender();
+		startEncoders();
+	}
+	if (trajectory != NULL) {
+		startTrajectory();
+	}
+	start = getTime();
+	for (i=0; i<batchSteps; i++) {
+		if ((renderEvery > 0) && (i % renderEvery == 0)) {
+			queueScene();
+		}
+		step();
+		stepCount++;
+		if (trajectory != NULL) {
+			queueTrajectory();
+		}
+	}
+	elapsed = getTime() - start;
+	printf("INFO: %d steps of %d bodies in %.3f s, %.2f steps/s\n", batchSteps, sampleSize, elapsed, batchSteps / elapsed);
+	if (trajectory != NULL) {
+		finishTrajectory();
+		checkTrajectory();
+	}
+	if (renderEvery > 0) {
+		waitEncoders();
+		if (video == NULL) {
+			printf("INFO: %d frames written to frame_NNNNN.png, %.3f s after the last step\n", renderCount, getTime() - start - elapsed);
+		}
+		closeVideo();
+	}
 }
 
 
@@ -714,6 +2559,9 @@ void init(void) {
 	glEnable(GL_AUTO_NORMAL);
 	glEnable(GL_CULL_FACE);
 	glDepthFunc(GL_LESS);
+	initSpheres();
+	initTrails();
+	initCapture();
 }
 
 
@@ -731,8 +2579,17 @@ void glmain(int argc, char *argv[]) {
 	glutMouseFunc(onMouse);
 	glutKeyboardFunc(onKeyboard);
 	glutTimerFunc(dt, onTimer, 0);
-	glutTimerFunc(dt, update, sampleSize);
 	init();
+	allocateSnapshots();
+	publishSnapshot();
+	acquireSnapshot();
+	if (trajectory != NULL) {
+		startTrajectory();
+	}
+	if (pthread_create(&simThread, NULL, simulate, NULL) != 0) {
+		printf("ERROR: cannot start the simulation thread\n");
+		exit(EXIT_FAILURE);
+	}
 	fprintf(stdout, "INFO: OpenGL Version: %s\n", glGetString(GL_VERSION));
 	fprintf(stdout, "INFO: Screen size (%d, %d)\n", glutGet(GLUT_SCREEN_WIDTH), glutGet(GLUT_SCREEN_HEIGHT));
 	fprintf(stdout, "INFO: Nbr elts: %d\n", sampleSize);
@@ -744,30 +2601,105 @@ void glmain(int argc, char *argv[]) {
 
 void populateObjects(void) {
 	int i = 0;
+	particles *p = NULL;
+	allocateObjects();
+	pathArena = alignedArray(3 * maxPathLength, sampleSize * sizeof(float));
+	pathHead = 0;
+	pathLength = 1;
+	p = objectsList;
 	for (i=0; i<sampleSize; i++) {
-		objectsList[i].id = i;
-		objectsList[i].selected = 0;
-		objectsList[i].color.x = generateFloatRandom();
-		objectsList[i].color.y = generateFloatRandom();
-		objectsList[i].color.z = generateFloatRandom();
-		objectsList[i].pos.x = generatePosRandom();
-		objectsList[i].pos.y = generatePosRandom();
-		objectsList[i].pos.z = generatePosRandom();
-		objectsList[i].velocity.x = generateRangeRandom(-1.0, 1.0);
-		objectsList[i].velocity.y = generateRangeRandom(-1.0, 1.0);
-		objectsList[i].velocity.z = generateRangeRandom(0.6, 1.6);
-		objectsList[i].mass = generateRangeRandom(minWeight, maxWeight);
-		objectsList[i].radius = pow(((3.0 * objectsList[i].mass) / (4.0 * pi * density)), (1.0/3.0));
-		objectsList[i].path = calloc(maxPathLength, sizeof(vector));
-		objectsList[i].path[pathLength] = objectsList[i].pos;
+		p->selected[i] = 0;
+		p->color[i].x = generateFloatRandom();
+		p->color[i].y = generateFloatRandom();
+		p->color[i].z = generateFloatRandom();
+		p->x[i] = generatePosRandom();
+		p->y[i] = generatePosRandom();
+		p->z[i] = generatePosRandom();
+		p->vx[i] = generateRangeRandom(-1.0, 1.0);
+		p->vy[i] = generateRangeRandom(-1.0, 1.0);
+		p->vz[i] = generateRangeRandom(0.6, 1.6);
+		p->mass[i] = generateRangeRandom(minWeight, maxWeight);
+		p->radius[i] = pow(((3.0 * p->mass[i]) / (4.0 * pi * density)), (1.0/3.0));
+		pathArena[3*i] = p->x[i];
+		pathArena[3*i+1] = p->y[i];
+		pathArena[3*i+2] = p->z[i];
+	}
+}
+
+
+void parseOptions(int argc, char *argv[]) {
+	int opt = 0;
+	while ((opt = getopt(argc, argv, "j:b:n:r:d:o:v:x:X:")) != -1) {
+		switch (opt) {
+			case 'j':
+				nbThreads = atoi(optarg);
+				break;
+			case 'b':
+				batchSteps = atoi(optarg);
+				break;
+			case 'd':
+				stepPeriod = atof(optarg);
+				break;
+			case 'o':
+				renderEvery = atoi(optarg);
+				break;
+			case 'v':
+				videoName = optarg;
+				break;
+			case 'x':
+				trajectoryName = optarg;
+				break;
+			case 'X':
+				openDump(optarg);
+				break;
+			case 'r':
+				maxPathLength = atoi(optarg);
+				if (maxPathLength < 1) {
+					printf("ERROR: trails need at least one point\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'n':
+				sampleSize = atoi(optarg);
+				if (sampleSize < 1) {
+					printf("ERROR: at least one body is needed\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			default:
+				exit(EXIT_FAILURE);
+				break;
+		}
+	}
+	if ((renderEvery > 0) && (batchSteps < 1)) {
+		printf("ERROR: offscreen frames are drawn in the batch mode, add -b steps\n");
+		exit(EXIT_FAILURE);
+	}
+	initPool();
+	// the outputs are created once the options are known to be valid
+	if (videoName != NULL) {
+		openVideo();
+	}
+	if (trajectoryName != NULL) {
+		openTrajectory();
 	}
+	printf("INFO: %d threads\n", nbThreads);
 }
 
 
 int main(int argc, char *argv[]) {
 	help();
+	parseOptions(argc, argv);
+	if (dumpName != NULL) {
+		dumpTrajectory();
+		exit(EXIT_SUCCESS);
+	}
 	srand(time(NULL));
 	populateObjects();
-	glmain(argc, argv);
+	if (batchSteps > 0) {
+		runBatch();
+	} else {
+		glmain(argc, argv);
+	}
 	exit(EXIT_SUCCESS);
 }
@@ -22,16 +22,57 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301, USA.*/
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <png.h>
+#include <zlib.h>
 
+#define GL_GLEXT_PROTOTYPES // instancing entry points are taken from libGL
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <GL/glut.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_KERNELS
+#endif
+
 #define WINDOW_TITLE_PREFIX "Universe simulation"
 #define couleur(param) printf("\033[%sm",param)
-#define BUFSIZE 512
-#define MAXOBJECTS 5000
+#define PICKLEAF 4 // spheres per leaf of the picking hierarchy
+#define CAPTURESLOTS 3 // frames read back at the same time
+#define ENCODERS 2 // PNG encoder threads
+#define ENCODEQUEUE 16 // frames waiting for an encoder before the window waits
+#define VIDEORATE 25 // frames per second announced in the Y4M header
+#define TRAJECTORYVERSION 2
+#define TRAJECTORYHEADER 40 // bytes of the file header
+#define TRAJECTORYBLOCK 64 // bytes of a block header
+#define TRAJECTORYCHUNK 16 // steps per compressed block of the trajectory file
+#define TRAJECTORYQUEUE 4 // steps waiting for the trajectory writer before the simulation waits
+#define TRAJECTORYSHIFT 6 // a position quantum is 2^TRAJECTORYSHIFT velocity quanta
+#define CHECKPOINTVERSION 1 // to be raised with any change of the checkpoint layout
+#define CHECKPOINTSECTIONS 11
+#define CHECKPOINTALIGN 4096 // sections start on a page of the file
+#define SPHERESTEPS 12 // slices and stacks of the sphere mesh
+#define SNAPSHOTFRESH 4 // latestSnapshot flag of a step the renderer has not taken
+#define MAXDEPTH 32 // octree depth limit, keeps coincident bodies in one leaf
+#define GROUPSIZE 64 // bodies of a subtree sharing one Barnes-Hut walk
+#define LISTSIZE 1024 // sources of an interaction list summed at once
+#define PAIRBLOCKS 16 // blocks the pair pass keeps at least, for the pool to share whatever its size
+#define DIRECT 0
+#define BARNESHUT 1
+#define FMM 2
+#define GRID 3
+#define KERNEL_SCALAR 0
+#define KERNEL_SSE2 1
+#define KERNEL_AVX2 2
+#define KERNEL_AVX512 3
 
 static short winSizeW = 1200,
 	winSizeH = 900,
@@ -44,12 +85,32 @@ static short winSizeW = 1200,
 	rotate = 1,
 	axe = 1,
 	concentration = 40,
+	engine = DIRECT,
+	cutoff = 1, // restrict gravity to minPerception
+	kernel = -1, // pairwise gravity kernel, -1 picks the best one for the cpu
+	singlePrecision = 0, // pair interactions evaluated in float32, sums kept in double
 	dt = 5; // in milliseconds
 
 static int textList = 0,
 	cpt = 0,
-	pathLength = 0,
+	pathLength = 0, // filled trail slots
+	pathHead = 0, // trail slot of the current positions
 	maxPathLength = 50,
+	leafSize = 0, // bodies per octree leaf, 0 picks the engine default
+	fmmOrder = 4, // order of the multipole and local expansions
+	fmmNbCoef = 0,
+	fmmNbM2M = 0,
+	fmmNbM2L = 0,
+	fmmNbL2L = 0,
+	fmmNbGrad = 0,
+	fmmCapacity = 0,
+	nbThreads = 0,
+	batchSteps = 0, // steps of the headless batch mode, 0 opens the window
+	blockSize = 128, // bodies per pool task
+	pairBlockSize = 0, // bodies per block of the pair pass, sized to the L2 cache
+	nbBlocks = 0,
+	tileSize = 0, // sources per tile of a pair block, sized to the L1 cache
+	errorSamples = 16,
 	sampleSize = 1500;
 
 static float fps = 0.0,
@@ -68,6 +129,8 @@ static double minPerception = 120.0,
 	maxWeight = 1.0e10,
 	minWeight = 1.0e6,
 	density = 1.0e8,
+	theta = 0.5, // Barnes-Hut opening angle
+	cutoffSquared = HUGE_VAL, // squared gravity range seen by the pair kernels
 	pi = 3.14159265358979323846,
 	g = 6.67428e-11;
 
@@ -75,20 +138,335 @@ typedef struct _vector {
 	double x, y, z;
 } vector;
 
-typedef struct _objects {
-	vector pos;
-	vector color;
-	vector velocity;
-	vector force;
-	vector *path;
-	double radius;
+// structure of arrays, every array is aligned for vector loads; mass, force,
+// float copies, radius and selected are shared by the two buffers
+typedef struct _particles {
+	double *x, *y, *z;
+	double *vx, *vy, *vz;
+	double *mass;
+	double *fx, *fy, *fz;
+	float *xf, *yf, *zf, *massf; // refreshed before each float32 pass
+	double *radius;
+	vector *color;
+	short *selected;
+} particles;
+
+
+// sources of a pair kernel, the reaction is subtracted from fx, fy and fz
+// unless they are NULL; the float32 kernels read xf, yf, zf and massf
+typedef struct _pairSource {
+	double *x, *y, *z;
+	double *mass;
+	double *fx, *fy, *fz;
+	float *xf, *yf, *zf, *massf;
+} pairSource;
+
+typedef void (*pairKernel)(vector pos, double gm, pairSource *s, int first, int last, vector *acc);
+
+static char *kernelName[] = {"scalar", "sse2", "avx2", "avx512"};
+static pairKernel pairForce = NULL;
+
+
+typedef struct _octreeNode {
+	vector center;
+	vector com;
+	double halfSize;
 	double mass;
-	int id;
-	short selected;
-} objects;
+	int first, count; // bodies range in octreeIndex
+	int child, nbChild; // children are stored contiguously
+} octreeNode;
+
+// point masses and bodies a Barnes-Hut group interacts with, laid out as a
+// pair kernel source
+typedef struct _interactionList {
+	int count;
+	double x[LISTSIZE], y[LISTSIZE], z[LISTSIZE], mass[LISTSIZE];
+	float xf[LISTSIZE], yf[LISTSIZE], zf[LISTSIZE], massf[LISTSIZE];
+} interactionList;
+
+
+// bodies are read from objectsList and written to nextList, swapped every step
+static particles objectsBuffer[2];
+static particles *objectsList = &objectsBuffer[0],
+	*nextList = &objectsBuffer[1];
+
+// trails of all bodies in one ring of maxPathLength slots, a step fills one
+// slot and the point of body o in slot s is at 3 * (s * sampleSize + o)
+static float *pathArena = NULL;
+
+// snapshots drawn by the window: the sim thread fills the back one, the
+// renderer draws the front one and latestSnapshot is the index of the last
+// complete step, the three are swapped with atomic exchanges and never locked;
+// a snapshot also carries, in the slots of the arena, the trail points of the
+// steps the renderer has not taken yet, so the sim never waits for it
+typedef struct _snapshot {
+	double *x, *y, *z;
+	double *vx, *vy, *vz;
+	double *radius;
+	vector *color;
+	short *selected;
+	float *trail;
+	int pathHead, pathLength;
+	long steps,
+		trailFirst; // first step whose points are in trail
+} snapshot;
+
+static snapshot snapshots[3];
+static snapshot *view = &snapshots[0];
+static int backSnapshot = 1,
+	frontSnapshot = 0;
+static atomic_int latestSnapshot = 2;
+static long stepCount = 0,
+	shownSteps = 0;
+static double stepPeriod = 0.0, // minimum milliseconds per step in the window, 0 runs free
+	stepRate = 0.0;
+static pthread_t simThread;
+static atomic_int simStop = 0; // ends the sim thread after its step
+static atomic_long trailShown = -1; // last step uploaded by the renderer, the sim only reads it
+
+// spheres share one unit mesh drawn once per body with instancing, the
+// instance buffer holds x, y, z, radius, r, g, b for every body; without
+// instancing a display list of the mesh is called per body
+static GLuint sphereList = 0,
+	sphereProgram = 0, // 0 when instancing is unavailable
+	sphereBuffers[3]; // mesh vertices, mesh indices and instances
+static GLint sphereVertex = 0,
+	sphereInstance = 0,
+	sphereTint = 0;
+static int sphereIndices = 0;
+static float *instanceData = NULL;
+
+// the trail arena mirrored in buffers of the same slot layout, with the colour
+// of each body at the time its point was uploaded; only the slots written by
+// the steps since the last upload are sent from the snapshot; a full ring is
+// drawn body by body through the indices, rasterizers such as llvmpipe are
+// twice as fast on points that are close on screen
+static GLuint trailBuffers[3]; // positions, colours and body-major indices
+static long trailSteps = -1; // step of the last upload
+static unsigned char *trailColors = NULL;
+
+// picking casts the cursor ray against a bounding volume hierarchy of the
+// drawn spheres, built on a click when a newer step is drawn; node n covers
+// the spheres pickIndex[pickFirst[n]] to pickIndex[pickLast[n] - 1], its box
+// is pickLo/pickHi[3*n] and its children are 2n+1 and 2n+2
+static int *pickIndex = NULL,
+	*pickFirst = NULL,
+	*pickLast = NULL,
+	boxActive = 0, // right drag in progress, corners in window coordinates
+	boxX0 = 0,
+	boxY0 = 0,
+	boxX1 = 0,
+	boxY1 = 0;
+static double *pickLo = NULL,
+	*pickHi = NULL;
+static long pickSteps = -1;
+static GLdouble pickModel[16],
+	pickProjection[16];
+static GLint pickPort[4];
 
+// captures are read back into pixel buffers without waiting and mapped
+// CAPTURESLOTS - 1 frames later, then PNG encoders take them from a queue;
+// offscreen frames come with a scene that the encoder draws first
+typedef struct _capture {
+	unsigned char *pixels;
+	float *scene; // x, y, z, radius, r, g, b of each body, NULL for read backs
+	int count; // bodies in scene
+	int width, height;
+	short verbose; // screenshots are reported, recorded frames are not
+	char name[32];
+} capture;
 
-static objects objectsList[MAXOBJECTS];
+static GLuint captureBuffers[CAPTURESLOTS];
+static capture captureSlots[CAPTURESLOTS];
+static long captureIssued[CAPTURESLOTS], // frame of each read back, -1 when free
+	captureFrame = 0;
+static int captureNext = 0,
+	recording = 0,
+	recordCount = 0,
+	encodeHead = 0,
+	encodeCount = 0,
+	encodeActive = 0;
+static char screenshotName[32] = "";
+static int renderEvery = 0, // steps between two offscreen frames of the batch mode, 0 draws none
+	renderCount = 0;
+static double renderView[12]; // rows of the offscreen camera, the initial one of the window
+
+// with a video, recorded and offscreen frames go to one writer thread in
+// order and are streamed as YUV 4:2:0 instead of PNG files
+static FILE *video = NULL;
+static char *videoName = NULL;
+static unsigned char *videoPlanes = NULL;
+static int videoWidth = 0, // set by the first frame, later frames of another size are skipped
+	videoHeight = 0,
+	videoFrames = 0,
+	videoHead = 0,
+	videoCount = 0,
+	videoActive = 0;
+static capture videoQueue[ENCODEQUEUE];
+
+// a checkpoint is this header followed by the arrays of the state, one
+// section each: x, y, z, vx, vy, vz, mass, radius, color, selected and the
+// trail ring; a forked child writes it from its copy on write image of the
+// step while the simulation goes on, the restart maps the file
+typedef struct _checkpointHeader {
+	char magic[8];
+	int version,
+		bodies,
+		pathPoints, // maxPathLength
+		pathHead,
+		pathLength,
+		sections;
+	long steps;
+	long offset[CHECKPOINTSECTIONS],
+		size[CHECKPOINTSECTIONS];
+} checkpointHeader;
+
+static int saveEvery = 0; // steps between two checkpoints, 0 saves none
+static char *checkpointName = "universe3d.chk",
+	*restartName = NULL;
+static pid_t checkpointWriter = 0; // child writing the last checkpoint, 0 when none
+static long checkpointSteps = 0;
+static pthread_t videoThread;
+static pthread_cond_t videoWake = PTHREAD_COND_INITIALIZER;
+
+// trajectory file, little endian with the layout given in README.md: a
+// header, then blocks of up to TRAJECTORYCHUNK steps, each a block header and
+// six zlib streams of zigzag varints, the columns x, y, z, vx, vy, vz in step
+// then body order; positions are counted in quanta of 1/1024 and velocities
+// of 1/65536, a velocity is stored as its change since the previous step and
+// a position as its distance to the previous one moved by the current
+// velocity, the first step of a block as is
+typedef struct _trajectoryHeader {
+	char magic[8];
+	int version,
+		bodies,
+		chunkSteps,
+		columns;
+	double positionQuantum,
+		velocityQuantum;
+} trajectoryHeader;
+
+typedef struct _trajectoryChunk {
+	long firstStep;
+	int steps,
+		reserved;
+	long size[6]; // compressed bytes of each column
+} trajectoryChunk;
+
+static FILE *trajectory = NULL,
+	*dumpOutput = NULL; // text output of -X
+static char *trajectoryName = NULL,
+	*dumpName = NULL;
+static double *trajectoryColumns[TRAJECTORYQUEUE][6]; // copies of the queued steps
+static long trajectoryStep[TRAJECTORYQUEUE],
+	trajectoryBytes = 0;
+static int trajectoryHead = 0,
+	trajectoryCount = 0,
+	trajectoryClosing = 0,
+	trajectoryWritten = 0;
+static pthread_t trajectoryThread;
+static pthread_mutex_t trajectoryMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trajectoryWake = PTHREAD_COND_INITIALIZER,
+	trajectoryRoom = PTHREAD_COND_INITIALIZER;
+static capture encodeQueue[ENCODEQUEUE];
+static pthread_t encoders[ENCODERS];
+static pthread_mutex_t encodeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t encodeWake = PTHREAD_COND_INITIALIZER,
+	encodeRoom = PTHREAD_COND_INITIALIZER;
+
+// GLSL 1.20 lights every vertex like the fixed pipeline, with its lights and material
+static const char *sphereVertexShader =
+	"#version 120\n"
+	"attribute vec3 vertex;\n"
+	"attribute vec4 instance;\n"
+	"attribute vec3 tint;\n"
+	"void main() {\n"
+	"	vec4 p = gl_ModelViewMatrix * vec4(instance.xyz + instance.w * vertex, 1.0);\n"
+	"	vec3 n = normalize(gl_NormalMatrix * vertex), v = normalize(-p.xyz), l;\n"
+	"	vec3 c = tint * gl_LightModel.ambient.rgb;\n"
+	"	for (int i=0; i<2; i++) {\n"
+	"		l = normalize(gl_LightSource[i].position.xyz - p.xyz);\n"
+	"		c += tint * (gl_LightSource[i].ambient.rgb + gl_LightSource[i].diffuse.rgb * max(dot(n, l), 0.0));\n"
+	"		if (dot(n, l) > 0.0) {\n"
+	"			c += gl_FrontMaterial.specular.rgb * gl_LightSource[i].specular.rgb * pow(max(dot(n, normalize(l + v)), 0.0), gl_FrontMaterial.shininess);\n"
+	"		}\n"
+	"	}\n"
+	"	gl_FrontColor = vec4(c, 1.0);\n"
+	"	gl_Position = gl_ProjectionMatrix * p;\n"
+	"}\n";
+static const char *sphereFragmentShader =
+	"#version 120\n"
+	"void main() {\n"
+	"	gl_FragColor = gl_Color;\n"
+	"}\n";
+
+static octreeNode *octree = NULL;
+static int octreeSize = 0,
+	octreeCapacity = 0,
+	nbGroups = 0,
+	*octreeIndex = NULL,
+	*octreeTemp = NULL,
+	*octreeGroups = NULL; // subtree roots of the Barnes-Hut walks
+static double *octreeX = NULL,
+	*octreeY = NULL,
+	*octreeZ = NULL,
+	*octreeMass = NULL;
+static float *octreeXf = NULL,
+	*octreeYf = NULL,
+	*octreeZf = NULL,
+	*octreeMassf = NULL;
+
+// Cartesian expansions: M_k = sum m (c - x)^k and L_n so that phi(c + y) = sum L_n y^n
+typedef struct _fmmTerm {
+	int target, source, shift;
+	double coef;
+} fmmTerm;
+
+static fmmTerm *fmmM2M = NULL,
+	*fmmM2L = NULL,
+	*fmmL2L = NULL,
+	*fmmGrad = NULL;
+static int *fmmExp = NULL, // exponents (x, y, z) of each coefficient
+	*fmmSlot = NULL,
+	*fmmPrev = NULL; // coefficients k-e_i and k-2e_i used by the derivative recurrence
+static double *fmmM = NULL,
+	*fmmL = NULL,
+	*fmmRadius = NULL,
+	*fmmSign = NULL;
+static double *fmmFx = NULL,
+	*fmmFy = NULL,
+	*fmmFz = NULL;
+
+// uniform cell grid, bodies are counting sorted by cell every step
+typedef struct _cellGrid {
+	vector low;
+	double cellSize;
+	int nx, ny, nz;
+	int cellCapacity;
+	int *cellStart;
+	int *index;
+	int *cell;
+	double *x, *y, *z;
+	double *mass;
+	float *xf, *yf, *zf, *massf;
+} cellGrid;
+
+static cellGrid colorGrid,
+	gravityGrid;
+
+// thread pool running numbered tasks, the calling thread takes part
+typedef void (*taskFunc)(int task);
+
+static pthread_t *workers = NULL;
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWake = PTHREAD_COND_INITIALIZER,
+	poolDone = PTHREAD_COND_INITIALIZER;
+static taskFunc poolFunc = NULL;
+static int poolTasks = 0,
+	poolNext = 0,
+	poolFinished = 0,
+	poolGeneration = 0,
+	pairRound = 0;
 
 
 
@@ -106,11 +484,32 @@ void help(void) {
 	printf("\t'z' and 'Z' to zoom in or out\n");
 	printf("\t'f' to switch to full screen\n");
 	printf("\t'p' to take a screenshot\n");
+	printf("\t'c' to start or stop recording every frame to numbered PNG files\n");
 	printf("\t'd' to display axe or not\n");
 	printf("\t't' to display selected planet trace or not\n");
 	printf("\t'a' to display trace of all planets\n");
 	printf("Mouse usage:\n");
 	printf("\t'LEFT CLICK' to select a planet\n");
+	printf("\t'RIGHT DRAG' to select the planets inside a box\n");
+	printf("Options:\n");
+	printf("\t'-e direct|bh|fmm|grid' gravity engine: all pairs, Barnes-Hut octree (faster above about 4000 bodies), fast multipole or cell grid\n");
+	printf("\t'-t theta' Barnes-Hut and FMM opening angle (default %.2f)\n", theta);
+	printf("\t'-p order' FMM expansion order (default %d)\n", fmmOrder);
+	printf("\t'-l size' bodies per octree leaf (default 8 for bh, 32 for fmm)\n");
+	printf("\t'-u' unlimited gravity range, ignore minPerception\n");
+	printf("\t'-k scalar|sse2|avx2|avx512' pairwise gravity kernel (default the widest supported)\n");
+	printf("\t'-f' evaluate pair interactions in float32, sums stay in double\n");
+	printf("\t'-j threads' number of worker threads (default all cores)\n");
+	printf("\t'-b steps' run steps without a window and report the steps per second\n");
+	printf("\t'-o every' with -b, draw a %dx%d frame every given steps to frame_NNNNN.png without a display\n", winSizeW, winSizeH);
+	printf("\t'-v file' stream the recorded or offscreen frames to file as Y4M video instead of PNG files, '-' for the standard output\n");
+	printf("\t'-s every' save a checkpoint of the whole state every given steps to %s, written in the background\n", checkpointName);
+	printf("\t'-i file' restart from a checkpoint, the number of bodies and the trail length are taken from it\n");
+	printf("\t'-x file' write the positions and velocities of every step to file, compressed by blocks of %d steps in the background\n", TRAJECTORYCHUNK);
+	printf("\t'-X file' print the steps of a trajectory written by -x as text on the standard output and quit\n");
+	printf("\t'-d period' minimum milliseconds per step in the window (default 0, as fast as possible)\n");
+	printf("\t'-n count' number of bodies (default %d)\n", sampleSize);
+	printf("\t'-r points' trail length in steps (default %d)\n", maxPathLength);
 	printf("\n");
 }
 
@@ -208,295 +607,1902 @@ vector limitForce(vector v, double max) {
 }
 
 
-double distance(objects o1, objects o2) {
+void *alignedArray(int n, size_t size) {
+	// arrays of 2 MiB or more are backed by reserved huge pages when there are
+	// some, otherwise transparent huge pages are requested for them
+	void *r = NULL;
+	size_t bytes = (size_t)n * size,
+		huge = 2 * 1024 * 1024;
+	if (bytes >= huge) {
+		bytes = ((bytes + huge - 1) / huge) * huge;
+#ifdef MAP_HUGETLB
+		r = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (r != MAP_FAILED) {
+			return(r);
+		}
+#endif
+		if (posix_memalign(&r, huge, bytes)) {
+			printf("ERROR: unable to allocate %d elements\n", n);
+			exit(EXIT_FAILURE);
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(r, bytes, MADV_HUGEPAGE);
+#endif
+	} else if (posix_memalign(&r, 64, bytes)) {
+		printf("ERROR: unable to allocate %d elements\n", n);
+		exit(EXIT_FAILURE);
+	}
+	memset(r, 0, bytes);
+	return(r);
+}
+
+
+vector getPos(particles *p, int i) {
 	vector r;
-	r = subVec(o2.pos, o1.pos);
-	return(magnitude(r));
+	r.x = p->x[i];
+	r.y = p->y[i];
+	r.z = p->z[i];
+	return(r);
 }
 
 
-void takeScreenshot(char *filename) {
-	FILE *fp = fopen(filename, "wb");
-	int width = glutGet(GLUT_WINDOW_WIDTH);
-	int height = glutGet(GLUT_WINDOW_HEIGHT);
-	png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	png_infop info = png_create_info_struct(png);
-	unsigned char *buffer = calloc((width * height * 3), sizeof(unsigned char));
-	int i;
+void allocateGrid(cellGrid *grid) {
+	grid->index = alignedArray(sampleSize, sizeof(int));
+	grid->cell = alignedArray(sampleSize, sizeof(int));
+	grid->x = alignedArray(sampleSize, sizeof(double));
+	grid->y = alignedArray(sampleSize, sizeof(double));
+	grid->z = alignedArray(sampleSize, sizeof(double));
+	grid->mass = alignedArray(sampleSize, sizeof(double));
+	grid->xf = alignedArray(sampleSize, sizeof(float));
+	grid->yf = alignedArray(sampleSize, sizeof(float));
+	grid->zf = alignedArray(sampleSize, sizeof(float));
+	grid->massf = alignedArray(sampleSize, sizeof(float));
+}
 
-	glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, (GLvoid *)buffer);
-	png_init_io(png, fp);
-	png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-	png_write_info(png, info);
-	for (i=0; i<height; i++) {
-		png_write_row(png, &(buffer[3*width*((height-1) - i)]));
+
+void allocateObjects(void) {
+	int b = 0;
+	for (b=0; b<2; b++) {
+		objectsBuffer[b].x = alignedArray(sampleSize, sizeof(double));
+		objectsBuffer[b].y = alignedArray(sampleSize, sizeof(double));
+		objectsBuffer[b].z = alignedArray(sampleSize, sizeof(double));
+		objectsBuffer[b].vx = alignedArray(sampleSize, sizeof(double));
+		objectsBuffer[b].vy = alignedArray(sampleSize, sizeof(double));
+		objectsBuffer[b].vz = alignedArray(sampleSize, sizeof(double));
+		objectsBuffer[b].color = alignedArray(sampleSize, sizeof(vector));
+	}
+	objectsBuffer[0].mass = alignedArray(sampleSize, sizeof(double));
+	objectsBuffer[0].fx = alignedArray(sampleSize, sizeof(double));
+	objectsBuffer[0].fy = alignedArray(sampleSize, sizeof(double));
+	objectsBuffer[0].fz = alignedArray(sampleSize, sizeof(double));
+	objectsBuffer[0].radius = alignedArray(sampleSize, sizeof(double));
+	objectsBuffer[0].selected = alignedArray(sampleSize, sizeof(short));
+	objectsBuffer[0].xf = alignedArray(sampleSize, sizeof(float));
+	objectsBuffer[0].yf = alignedArray(sampleSize, sizeof(float));
+	objectsBuffer[0].zf = alignedArray(sampleSize, sizeof(float));
+	objectsBuffer[0].massf = alignedArray(sampleSize, sizeof(float));
+	objectsBuffer[1].mass = objectsBuffer[0].mass;
+	objectsBuffer[1].fx = objectsBuffer[0].fx;
+	objectsBuffer[1].fy = objectsBuffer[0].fy;
+	objectsBuffer[1].fz = objectsBuffer[0].fz;
+	objectsBuffer[1].radius = objectsBuffer[0].radius;
+	objectsBuffer[1].selected = objectsBuffer[0].selected;
+	objectsBuffer[1].xf = objectsBuffer[0].xf;
+	objectsBuffer[1].yf = objectsBuffer[0].yf;
+	objectsBuffer[1].zf = objectsBuffer[0].zf;
+	objectsBuffer[1].massf = objectsBuffer[0].massf;
+	allocateGrid(&colorGrid);
+	if (engine == GRID) {
+		allocateGrid(&gravityGrid);
+	}
+	if ((engine == BARNESHUT) | (engine == FMM)) {
+		octreeIndex = alignedArray(sampleSize, sizeof(int));
+		octreeTemp = alignedArray(sampleSize, sizeof(int));
+		octreeGroups = alignedArray(sampleSize, sizeof(int));
+		octreeX = alignedArray(sampleSize, sizeof(double));
+		octreeY = alignedArray(sampleSize, sizeof(double));
+		octreeZ = alignedArray(sampleSize, sizeof(double));
+		octreeMass = alignedArray(sampleSize, sizeof(double));
+		octreeXf = alignedArray(sampleSize, sizeof(float));
+		octreeYf = alignedArray(sampleSize, sizeof(float));
+		octreeZf = alignedArray(sampleSize, sizeof(float));
+		octreeMassf = alignedArray(sampleSize, sizeof(float));
+	}
+	if (engine == FMM) {
+		fmmFx = alignedArray(sampleSize, sizeof(double));
+		fmmFy = alignedArray(sampleSize, sizeof(double));
+		fmmFz = alignedArray(sampleSize, sizeof(double));
 	}
-	png_write_end(png, NULL);
-	png_destroy_write_struct(&png, &info);
-	free(buffer);
-	fclose(fp);
-	printf("INFO: Save screenshot on %s (%d x %d)\n", filename, width, height);
 }
 
 
-char* displayObject(objects o, int simple) {
-	char *text = NULL;
-	text = calloc(120, sizeof(text));
-	if (simple) {
-		sprintf(text, "[%d] coord: (%.2f, %.2f, %.2f)", o.id, o.pos.x, o.pos.y, o.pos.z);
-	} else {
-		sprintf(text, "[%d] coord: (%.2f, %.2f, %.2f) velocity: (%.2f, %.2f, %.2f)\n", o.id, o.pos.x, o.pos.y, o.pos.z, o.velocity.x, o.velocity.y, o.velocity.z);
+void allocateSnapshots(void) {
+	// the radius and selection flags are shared by all the snapshots
+	int f = 0;
+	for (f=0; f<3; f++) {
+		snapshots[f].x = alignedArray(sampleSize, sizeof(double));
+		snapshots[f].y = alignedArray(sampleSize, sizeof(double));
+		snapshots[f].z = alignedArray(sampleSize, sizeof(double));
+		snapshots[f].vx = alignedArray(sampleSize, sizeof(double));
+		snapshots[f].vy = alignedArray(sampleSize, sizeof(double));
+		snapshots[f].vz = alignedArray(sampleSize, sizeof(double));
+		snapshots[f].color = alignedArray(sampleSize, sizeof(vector));
+		snapshots[f].radius = objectsList->radius;
+		snapshots[f].selected = objectsList->selected;
+		snapshots[f].trail = alignedArray(3 * maxPathLength, sampleSize * sizeof(float));
+		snapshots[f].trailFirst = 0;
+		snapshots[f].steps = -1;
 	}
-	return(text);
 }
 
 
-void drawObject(objects o, int name) {
-	glPushMatrix();
-	glTranslatef(o.pos.x, o.pos.y, o.pos.z);
-	if (o.selected) {
-		glColor3f(1.0, 0.0, 0.0);
-		glutWireCube(o.radius * 2.0);
+void publishSnapshot(void) {
+	// sim thread side, the filled snapshot becomes the latest one
+	snapshot *f = &snapshots[backSnapshot];
+	size_t size = 3 * (size_t)sampleSize;
+	long s = 0,
+		last = f->steps,
+		from = atomic_load(&trailShown) + 1;
+	int slot = 0;
+	memcpy(f->x, objectsList->x, sampleSize * sizeof(double));
+	memcpy(f->y, objectsList->y, sampleSize * sizeof(double));
+	memcpy(f->z, objectsList->z, sampleSize * sizeof(double));
+	memcpy(f->vx, objectsList->vx, sampleSize * sizeof(double));
+	memcpy(f->vy, objectsList->vy, sampleSize * sizeof(double));
+	memcpy(f->vz, objectsList->vz, sampleSize * sizeof(double));
+	memcpy(f->color, objectsList->color, sampleSize * sizeof(vector));
+	f->pathHead = pathHead;
+	f->pathLength = pathLength;
+	f->steps = stepCount;
+	// the points of the steps after the last upload that are still in the
+	// arena, a recycled snapshot already holds most of them when the renderer
+	// falls behind, so only a few slots are copied per step
+	if (from < stepCount - pathLength + 1) {
+		from = stepCount - pathLength + 1;
 	}
-	glColor3f(o.color.x, o.color.y, o.color.z);
-	glLoadName(name);
-	glutSolidSphere(o.radius, 12, 12);
-	glPopMatrix();
+	for (s=from; s<=stepCount; s++) {
+		if ((s < f->trailFirst) | (s > last)) {
+			slot = (pathHead - (int)(stepCount - s) + maxPathLength) % maxPathLength;
+			memcpy(&f->trail[slot * size], &pathArena[slot * size], size * sizeof(float));
+		}
+	}
+	f->trailFirst = from;
+	backSnapshot = atomic_exchange(&latestSnapshot, backSnapshot | SNAPSHOTFRESH) & 3;
 }
 
 
-void drawPath(objects o) {
-	int i = 0;
-	glPointSize(0.5f);
-	glColor3f(o.color.x, o.color.y, o.color.z);
-	for (i=0; i<maxPathLength; i++) {
-		glBegin(GL_POINTS);
-			glNormal3f(o.path[i].x, o.path[i].y, o.path[i].z);
-			glVertex3f(o.path[i].x, o.path[i].y, o.path[i].z);
-		glEnd();
+void acquireSnapshot(void) {
+	// renderer side, takes the latest snapshot if a step has completed since
+	if (atomic_load(&latestSnapshot) & SNAPSHOTFRESH) {
+		frontSnapshot = atomic_exchange(&latestSnapshot, frontSnapshot) & 3;
+		view = &snapshots[frontSnapshot];
 	}
 }
 
 
-void drawString(float x, float y, float z, char *text) {
-	unsigned i = 0;
-	glPushMatrix();
-	glLineWidth(1.0);
-	glColor3f(1.0, 1.0, 1.0); // Black background
-	glTranslatef(x, y, z);
-	glScalef(0.008, 0.008, 0.008);
-	for(i=0; i < strlen(text); i++) {
-		glutStrokeCharacter(GLUT_STROKE_MONO_ROMAN, (int)text[i]);
+void stopSimulation(void) {
+	// the sim thread ends after its current step, nothing feeds the writers then
+	atomic_store(&simStop, 1);
+	pthread_join(simThread, NULL);
+}
+
+
+void initRender(void) {
+	// modelview of the window before any key is pressed: the translation by
+	// (xx, yy, -zoom) then the rotations about x, y and z
+	double cx = cos(rotx * pi / 180.0), sx = sin(rotx * pi / 180.0),
+		cy = cos(roty * pi / 180.0), sy = sin(roty * pi / 180.0),
+		cz = cos(rotz * pi / 180.0), sz = sin(rotz * pi / 180.0);
+	double m[12] = {
+		cy * cz, -cy * sz, sy, xx,
+		cx * sz + sx * sy * cz, cx * cz - sx * sy * sz, -sx * cy, yy,
+		sx * sz - cx * sy * cz, sx * cz + cx * sy * sz, cx * cy, -zoom};
+	memcpy(renderView, m, sizeof(m));
+}
+
+
+void renderLine(capture *c, float *depth, double *a, double *b) {
+	// segment between two projected points (x, y, distance) in grey, depth tested
+	int i = 0, n = 0, x = 0, y = 0;
+	double t = 0.0, d = 0.0;
+	n = (int)fmax(fabs(b[0] - a[0]), fabs(b[1] - a[1])) + 1;
+	for (i=0; i<=n; i++) {
+		t = (double)i / n;
+		x = (int)(a[0] + t * (b[0] - a[0]));
+		y = (int)(a[1] + t * (b[1] - a[1]));
+		d = a[2] + t * (b[2] - a[2]);
+		if ((x >= 0) && (x < c->width) && (y >= 0) && (y < c->height) && (d < depth[y * c->width + x])) {
+			depth[y * c->width + x] = d;
+			memset(&c->pixels[3 * (y * c->width + x)], 102, 3);
+		}
 	}
-	glPopMatrix();
 }
 
 
-void drawText(void) {
-	int i = 0;
-	char text1[50], text2[70], text3[120];
-	sprintf(text1, "Nbr of objects: %d", sampleSize);
-	sprintf(text2, "dt: %1.3f, FPS: %4.2f", (dt/1000.0), fps);
-	for (i=0; i<sampleSize; i++) {
-		if (objectsList[i].selected) {
-			sprintf(text3, "%s", displayObject(objectsList[i], 0));
+void renderScene(capture *c) {
+	// CPU rasterizer of the offscreen frames: the bodies are lit discs with a
+	// per pixel depth and the same lights and material as the window
+	int i = 0, j = 0, k = 0, x = 0, y = 0, x0 = 0, x1 = 0, y0 = 0, y1 = 0;
+	double *v = renderView;
+	double focal = 0.5 * c->height / tan(45.0 * pi / 360.0), // 45 degrees of field of view
+		corner[8][3];
+	double ex = 0.0, ey = 0.0, ez = 0.0, px = 0.0, py = 0.0, r = 0.0, dx = 0.0, dy = 0.0, q = 0.0, nz = 0.0, spec = 0.0, z = 0.0, light = 0.0;
+	float *s = NULL,
+		*depth = malloc((size_t)c->width * c->height * sizeof(float));
+	unsigned char *pixel = NULL;
+	c->pixels = malloc(3 * (size_t)c->width * c->height);
+	memset(c->pixels, 26, 3 * (size_t)c->width * c->height);
+	for (i=0; i<c->width*c->height; i++) {
+		depth[i] = 1000.0;
+	}
+	if (axe) {
+		for (i=0; i<8; i++) {
+			ex = (i & 1) ? 150.0 : -150.0;
+			ey = (i & 2) ? 150.0 : -150.0;
+			ez = (i & 4) ? 150.0 : -150.0;
+			z = -(v[8] * ex + v[9] * ey + v[10] * ez + v[11]);
+			corner[i][0] = 0.5 * c->width + focal * (v[0] * ex + v[1] * ey + v[2] * ez + v[3]) / z;
+			corner[i][1] = 0.5 * c->height + focal * (v[4] * ex + v[5] * ey + v[6] * ez + v[7]) / z;
+			corner[i][2] = z;
+		}
+		for (i=0; i<8; i++) {
+			for (j=1; j<8; j<<=1) {
+				if (!(i & j) && (corner[i][2] > 1.0) && (corner[i | j][2] > 1.0)) {
+					renderLine(c, depth, corner[i], corner[i | j]);
+				}
+			}
 		}
 	}
-	textList = glGenLists(1);
-	glNewList(textList, GL_COMPILE);
-	drawString(-40.0, -36.0, -100.0, text1);
-	drawString(-40.0, -38.0, -100.0, text2);
-	drawString(-40.0, -40.0, -100.0, text3);
-	glEndList();
+	for (i=0; i<c->count; i++) {
+		s = &c->scene[7*i];
+		ex = v[0] * s[0] + v[1] * s[1] + v[2] * s[2] + v[3];
+		ey = v[4] * s[0] + v[5] * s[1] + v[6] * s[2] + v[7];
+		ez = -(v[8] * s[0] + v[9] * s[1] + v[10] * s[2] + v[11]);
+		if ((ez - s[3] < 1.0) || (ez > 1000.0)) {
+			continue;
+		}
+		px = 0.5 * c->width + focal * ex / ez;
+		py = 0.5 * c->height + focal * ey / ez;
+		r = focal * s[3] / ez;
+		if (r < 0.5) {
+			r = 0.5; // far bodies still cover their pixel
+		}
+		x0 = (int)fmax(px - r, 0.0);
+		x1 = (int)fmin(px + r, c->width - 1.0);
+		y0 = (int)fmax(py - r, 0.0);
+		y1 = (int)fmin(py + r, c->height - 1.0);
+		for (y=y0; y<=y1; y++) {
+			for (x=x0; x<=x1; x++) {
+				dx = (x + 0.5 - px) / r;
+				dy = (y + 0.5 - py) / r;
+				q = 1.0 - dx * dx - dy * dy;
+				if (q <= 0.0) {
+					continue;
+				}
+				nz = sqrt(q);
+				z = ez - nz * s[3];
+				if (z >= depth[y * c->width + x]) {
+					continue;
+				}
+				depth[y * c->width + x] = z;
+				// ambient of the model and of both lights, then their diffuse
+				// and specular terms with the lights next to the eye
+				light = 0.7 + 1.6 * nz;
+				spec = nz;
+				for (k=0; k<7; k++) {
+					spec *= spec;
+				}
+				spec *= 1.6 * 255.0;
+				pixel = &c->pixels[3 * (y * c->width + x)];
+				pixel[0] = (unsigned char)fmin(255.0 * s[4] * light + spec, 255.0);
+				pixel[1] = (unsigned char)fmin(255.0 * s[5] * light + spec, 255.0);
+				pixel[2] = (unsigned char)fmin(255.0 * s[6] * light + spec, 255.0);
+			}
+		}
+	}
+	free(depth);
 }
 
 
-void drawAxes(void) {
-	glPushMatrix();
-	glLineWidth(1.0);
-	glTranslatef(0.0, 0.0, 0.0);
-	glColor3f(0.4, 0.4, 0.4);
-	glutWireCube(100.0*3.0);
-	glPopMatrix();
+void writePng(capture *c) {
+	FILE *fp = fopen(c->name, "wb");
+	png_structp png = NULL;
+	png_infop info = NULL;
+	int i;
+	if (fp == NULL) {
+		printf("INFO: cannot write %s\n", c->name);
+		return;
+	}
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info = png_create_info_struct(png);
+	png_init_io(png, fp);
+	png_set_IHDR(png, info, c->width, c->height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	if (!c->verbose) {
+		// recorded frames favour encoding speed over size
+		png_set_compression_level(png, 1);
+		png_set_filter(png, 0, PNG_FILTER_SUB);
+	}
+	png_write_info(png, info);
+	for (i=0; i<c->height; i++) {
+		png_write_row(png, &(c->pixels[3*c->width*((c->height-1) - i)]));
+	}
+	png_write_end(png, NULL);
+	png_destroy_write_struct(&png, &info);
+	fclose(fp);
+	if (c->verbose) {
+		printf("INFO: Save screenshot on %s (%d x %d)\n", c->name, c->width, c->height);
+	}
 }
 
 
-void display(void) {
-	int i=0;
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
+void openVideo(void) {
+	// "-" streams to the standard output, which then carries the video only:
+	// it is duplicated and fd 1 becomes stderr, so printf, including the help
+	// still buffered, goes there
+	int fd = 0;
+	char *name = videoName;
+	if (strcmp(name, "-") == 0) {
+		videoName = "the standard output";
+		fd = dup(STDOUT_FILENO);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		video = fdopen(fd, "wb");
+	} else {
+		video = fopen(name, "wb");
+	}
+	if (video == NULL) {
+		printf("ERROR: cannot write the video to %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+}
 
-	drawText();
-	glCallList(textList);
 
-	glPushMatrix();
-	glTranslatef(xx, yy, -zoom);
-	glRotatef(rotx, 1.0, 0.0, 0.0);
-	glRotatef(roty, 0.0, 1.0, 0.0);
-	glRotatef(rotz, 0.0, 0.0, 1.0);
+void writeVideo(capture *c) {
+	// converts to full range BT.601 YUV, chroma averaged over 2x2 pixels, and
+	// flips the rows: Y4M frames are stored from the top
+	int x = 0, y = 0, r = 0, g = 0, b = 0;
+	unsigned char *p = NULL, *q = NULL,
+		*lum = NULL, *cb = NULL, *cr = NULL;
+	if (videoWidth == 0) {
+		videoWidth = c->width & ~1;
+		videoHeight = c->height & ~1;
+		videoPlanes = malloc(3 * (size_t)videoWidth * videoHeight / 2);
+		fprintf(video, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", videoWidth, videoHeight, VIDEORATE);
+	}
+	if (((c->width & ~1) != videoWidth) || ((c->height & ~1) != videoHeight)) {
+		printf("INFO: frame of %d x %d skipped, the video is %d x %d\n", c->width, c->height, videoWidth, videoHeight);
+		return;
+	}
+	lum = videoPlanes;
+	cb = lum + (size_t)videoWidth * videoHeight;
+	cr = cb + (size_t)videoWidth * videoHeight / 4;
+	for (y=0; y<videoHeight; y+=2) {
+		p = &c->pixels[3 * (size_t)c->width * (c->height - 1 - y)];
+		q = p - 3 * (size_t)c->width;
+		for (x=0; x<videoWidth; x+=2) {
+			lum[y*videoWidth+x] = (77 * p[3*x] + 150 * p[3*x+1] + 29 * p[3*x+2] + 128) >> 8;
+			lum[y*videoWidth+x+1] = (77 * p[3*x+3] + 150 * p[3*x+4] + 29 * p[3*x+5] + 128) >> 8;
+			lum[(y+1)*videoWidth+x] = (77 * q[3*x] + 150 * q[3*x+1] + 29 * q[3*x+2] + 128) >> 8;
+			lum[(y+1)*videoWidth+x+1] = (77 * q[3*x+3] + 150 * q[3*x+4] + 29 * q[3*x+5] + 128) >> 8;
+			r = p[3*x] + p[3*x+3] + q[3*x] + q[3*x+3];
+			g = p[3*x+1] + p[3*x+4] + q[3*x+1] + q[3*x+4];
+			b = p[3*x+2] + p[3*x+5] + q[3*x+2] + q[3*x+5];
+			cb[(y/2)*(videoWidth/2)+x/2] = (128 * 1024 - 43 * r - 85 * g + 128 * b + 512) >> 10;
+			cr[(y/2)*(videoWidth/2)+x/2] = (128 * 1024 + 128 * r - 107 * g - 21 * b + 512) >> 10;
+		}
+	}
+	fputs("FRAME\n", video);
+	fwrite(videoPlanes, 1, 3 * (size_t)videoWidth * videoHeight / 2, video);
+	fflush(video); // an encoder reading a pipe gets every frame at once
+	videoFrames++;
+}
 
-	GLfloat ambient1[] = {0.15f, 0.15f, 0.15f, 1.0f};
-	GLfloat diffuse1[] = {0.8f, 0.8f, 0.8f, 1.0f};
-	GLfloat specular1[] = {1.0f, 1.0f, 1.0f, 1.0f};
-	GLfloat position1[] = {0.0f, 0.0f, 20.0f, 1.0f};
-	glLightfv(GL_LIGHT1, GL_AMBIENT, ambient1);
-	glLightfv(GL_LIGHT1, GL_DIFFUSE, diffuse1);
-	glLightfv(GL_LIGHT1, GL_DIFFUSE, specular1);
-	glLightfv(GL_LIGHT1, GL_POSITION, position1);
-	glEnable(GL_LIGHT1);
 
-	if (axe) { drawAxes(); }
-	for (i=0; i<sampleSize; i++) {
-		drawObject(objectsList[i], i);
-		if (trace) {
-			if (objectsList[i].selected) {
-				drawPath(objectsList[i]);
-			}
+void *videoWorker(void *arg) {
+	capture job;
+	(void)arg;
+	pthread_mutex_lock(&encodeMutex);
+	for (;;) {
+		while (videoCount == 0) {
+			pthread_cond_wait(&videoWake, &encodeMutex);
 		}
-		if (allTraces) {
-			drawPath(objectsList[i]);
+		job = videoQueue[videoHead];
+		videoHead = (videoHead + 1) % ENCODEQUEUE;
+		videoCount--;
+		videoActive++;
+		pthread_mutex_unlock(&encodeMutex);
+		if (job.scene != NULL) {
+			renderScene(&job);
+			free(job.scene);
 		}
+		writeVideo(&job);
+		free(job.pixels);
+		pthread_mutex_lock(&encodeMutex);
+		videoActive--;
+		pthread_cond_broadcast(&encodeRoom);
 	}
-	glPopMatrix();
+	return(NULL);
+}
 
-	glutSwapBuffers();
-	glutPostRedisplay();
+
+void *encoderWorker(void *arg) {
+	capture job;
+	(void)arg;
+	pthread_mutex_lock(&encodeMutex);
+	for (;;) {
+		while (encodeCount == 0) {
+			pthread_cond_wait(&encodeWake, &encodeMutex);
+		}
+		job = encodeQueue[encodeHead];
+		encodeHead = (encodeHead + 1) % ENCODEQUEUE;
+		encodeCount--;
+		encodeActive++;
+		pthread_mutex_unlock(&encodeMutex);
+		if (job.scene != NULL) {
+			renderScene(&job);
+			free(job.scene);
+		}
+		writePng(&job);
+		free(job.pixels);
+		pthread_mutex_lock(&encodeMutex);
+		encodeActive--;
+		pthread_cond_broadcast(&encodeRoom);
+	}
+	return(NULL);
 }
 
 
-void processSelectedObject(GLint hitsNumber, GLuint *selectBuffer) {
-	int objectName = 0;
-	if (hitsNumber == 1) {
-		objectName = selectBuffer[3];
-		objectsList[objectName].selected = !objectsList[objectName].selected;
-		printf("INFO: Touched -> %s", displayObject(objectsList[objectName], 1));
+void queueCapture(capture *c) {
+	// waits only when every encoder is behind by ENCODEQUEUE frames
+	pthread_mutex_lock(&encodeMutex);
+	if ((video != NULL) && !c->verbose) {
+		while (videoCount == ENCODEQUEUE) {
+			pthread_cond_wait(&encodeRoom, &encodeMutex);
+		}
+		// the pixels are handed over, not copied
+		videoQueue[(videoHead + videoCount) % ENCODEQUEUE] = *c;
+		videoCount++;
+		pthread_cond_signal(&videoWake);
+		pthread_mutex_unlock(&encodeMutex);
+		return;
+	}
+	while (encodeCount == ENCODEQUEUE) {
+		pthread_cond_wait(&encodeRoom, &encodeMutex);
 	}
+	encodeQueue[(encodeHead + encodeCount) % ENCODEQUEUE] = *c;
+	encodeCount++;
+	pthread_cond_signal(&encodeWake);
+	pthread_mutex_unlock(&encodeMutex);
 }
 
 
-void selectObject(int x, int y) {
-	GLuint selectBuffer[BUFSIZE];
-	GLint hitsNumber;
-	GLint viewPort[4];
+void startEncoders(void) {
+	int i = 0;
+	for (i=0; i<ENCODERS; i++) {
+		if (pthread_create(&encoders[i], NULL, encoderWorker, NULL)) {
+			printf("ERROR: unable to start encoder thread %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if ((video != NULL) && pthread_create(&videoThread, NULL, videoWorker, NULL)) {
+		printf("ERROR: unable to start the video thread\n");
+		exit(EXIT_FAILURE);
+	}
+}
 
-	glGetIntegerv(GL_VIEWPORT, viewPort);
-	glSelectBuffer(BUFSIZE, selectBuffer);
-	(void) glRenderMode(GL_SELECT);
-	glInitNames();
-	glPushName(0);
 
-	glMatrixMode(GL_PROJECTION);
-	glPushMatrix();
-	glLoadIdentity();
-	glGetIntegerv(GL_VIEWPORT, viewPort);
-	gluPickMatrix(x, y, 1.0, 1.0, viewPort);
-	gluPerspective(45.0, 1.0, 1.0, 1000.0);
-	glMatrixMode(GL_MODELVIEW);
-	glutSwapBuffers();
-	display();
-	glMatrixMode(GL_PROJECTION);
-	glPopMatrix();
-	glMatrixMode(GL_MODELVIEW);
-	hitsNumber = glRenderMode(GL_RENDER);
-	glFlush();
-	glutPostRedisplay();
-	processSelectedObject(hitsNumber, selectBuffer);
+void waitEncoders(void) {
+	pthread_mutex_lock(&encodeMutex);
+	while ((encodeCount > 0) || (encodeActive > 0) || (videoCount > 0) || (videoActive > 0)) {
+		pthread_cond_wait(&encodeRoom, &encodeMutex);
+	}
+	pthread_mutex_unlock(&encodeMutex);
 }
 
 
-void onReshape(int width, int height) {
-	glViewport(0, 0, width, height);
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	gluPerspective(45.0, width/height, 1.0, 1000.0);
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
+void closeVideo(void) {
+	if (video != NULL) {
+		fclose(video);
+		video = NULL;
+		printf("INFO: %d frames of %d x %d streamed to %s\n", videoFrames, videoWidth, videoHeight, videoName);
+	}
 }
 
 
-void onSpecial(int key, int x, int y) {
-	switch (key) {
-		case GLUT_KEY_UP:
-			rotx += 5.0;
-			printf("INFO: x = %f\n", rotx);
-			break;
-		case GLUT_KEY_DOWN:
-			rotx -= 5.0;
-			printf("INFO: x = %f\n", rotx);
-			break;
-		case GLUT_KEY_LEFT:
-			rotz += 5.0;
-			printf("INFO: z = %f\n", rotz);
-			break;
-		case GLUT_KEY_RIGHT:
-			rotz -= 5.0;
-			printf("INFO: z = %f\n", rotz);
-			break;
-		default:
-			printf("x %d, y %d\n", x, y);
-			break;
+void initCapture(void) {
+	int i = 0;
+	glGenBuffers(CAPTURESLOTS, captureBuffers);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	for (i=0; i<CAPTURESLOTS; i++) {
+		captureIssued[i] = -1;
 	}
-	glutPostRedisplay();
+	startEncoders();
 }
 
 
-void onMotion(int x, int y) {
-	if (prevx) {
-		xx += ((x - prevx)/10.0);
-		printf("INFO: x = %f\n", xx);
+void collectCapture(int slot) {
+	// the mapping waits for the read back if it has not completed yet
+	capture *c = &captureSlots[slot];
+	size_t size = 3 * (size_t)c->width * c->height;
+	unsigned char *mapped = NULL;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, captureBuffers[slot]);
+	mapped = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+	if (mapped != NULL) {
+		c->pixels = malloc(size);
+		memcpy(c->pixels, mapped, size);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		queueCapture(c);
 	}
-	if (prevy) {
-		yy -= ((y - prevy)/10.0);
-		printf("INFO: y = %f\n", yy);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	captureIssued[slot] = -1;
+}
+
+
+void readCapture(char *name, short verbose) {
+	// starts the read back of the frame drawn in the back buffer
+	int slot = captureNext;
+	capture *c = &captureSlots[slot];
+	if (captureIssued[slot] >= 0) {
+		collectCapture(slot);
 	}
-	prevx = x;
-	prevy = y;
-	glutPostRedisplay();
+	c->width = glutGet(GLUT_WINDOW_WIDTH);
+	c->height = glutGet(GLUT_WINDOW_HEIGHT);
+	c->scene = NULL;
+	c->verbose = verbose;
+	snprintf(c->name, sizeof(c->name), "%s", name);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, captureBuffers[slot]);
+	glBufferData(GL_PIXEL_PACK_BUFFER, 3 * (size_t)c->width * c->height, NULL, GL_STREAM_READ);
+	glReadPixels(0, 0, c->width, c->height, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	captureIssued[slot] = captureFrame;
+	captureNext = (slot + 1) % CAPTURESLOTS;
 }
 
 
-void onIdle(void) {
-	frame += 1;
-	currentTime = glutGet(GLUT_ELAPSED_TIME);
-	if (currentTime - timebase >= 1000.0){
-		fps = frame*1000.0 / (currentTime-timebase);
-		timebase = currentTime;
-		frame = 0;
+void captureDisplay(void) {
+	// called once per frame before the swap
+	int i = 0;
+	char name[32];
+	if (screenshotName[0]) {
+		readCapture(screenshotName, 1);
+		screenshotName[0] = 0;
 	}
-	glutPostRedisplay();
+	if (recording) {
+		sprintf(name, "record_%.5d.png", recordCount++);
+		readCapture(name, 0);
+	}
+	for (i=0; i<CAPTURESLOTS; i++) {
+		if ((captureIssued[i] >= 0) && (captureFrame - captureIssued[i] >= CAPTURESLOTS - 1)) {
+			collectCapture(i);
+		}
+	}
+	captureFrame++;
 }
 
 
-void onMouse(int button, int state, int x, int y) {
-	switch (button) {
-		case GLUT_LEFT_BUTTON:
-			if (state == GLUT_DOWN) {
-				printf("INFO: left button, x %d, y %d\n", x, y);
-				selectObject(x, winSizeH-y);
-			}
-			break;
-		case GLUT_RIGHT_BUTTON:
-			if (state == GLUT_DOWN) {
-				printf("INFO: right button, x %d, y %d\n", x, y);
-			}
-			break;
+void finishCaptures(void) {
+	// hands the pending read backs over and waits for the encoders
+	int i = 0;
+	for (i=0; i<CAPTURESLOTS; i++) {
+		if (captureIssued[i] >= 0) {
+			collectCapture(i);
+		}
 	}
+	waitEncoders();
+	closeVideo();
 }
 
 
-void onKeyboard(unsigned char key, int x, int y) {
-	char *name = malloc(20 * sizeof(char));
-	switch (key) {
-		case 27: // Escape
-			printf("INFO: exit\n");
-			printf("x %d, y %d\n", x, y);
-			exit(0);
-			break;
-		case 'x':
-			xx += 1.0;
-			printf("INFO: x = %f\n", xx);
-			break;
+void takeScreenshot(char *filename) {
+	// the next frame is captured once drawn
+	snprintf(screenshotName, sizeof(screenshotName), "%s", filename);
+}
+
+
+void queueScene(void) {
+	// sim thread side of an offscreen frame, only the bodies are copied
+	capture c;
+	particles *p = objectsList;
+	int i = 0;
+	c.scene = malloc(7 * (size_t)sampleSize * sizeof(float));
+	c.count = sampleSize;
+	c.pixels = NULL;
+	c.width = winSizeW;
+	c.height = winSizeH;
+	c.verbose = 0;
+	for (i=0; i<sampleSize; i++) {
+		c.scene[7*i] = p->x[i];
+		c.scene[7*i+1] = p->y[i];
+		c.scene[7*i+2] = p->z[i];
+		c.scene[7*i+3] = p->radius[i];
+		c.scene[7*i+4] = p->color[i].x;
+		c.scene[7*i+5] = p->color[i].y;
+		c.scene[7*i+6] = p->color[i].z;
+	}
+	sprintf(c.name, "frame_%.5d.png", renderCount++);
+	queueCapture(&c);
+}
+
+
+void checkpointLayout(checkpointHeader *h, char **data) {
+	// sections of the current state with their place in the file
+	particles *p = objectsList;
+	size_t n = sampleSize;
+	long offset = CHECKPOINTALIGN;
+	int i = 0;
+	char *arrays[CHECKPOINTSECTIONS] = {(char *)p->x, (char *)p->y, (char *)p->z, (char *)p->vx, (char *)p->vy, (char *)p->vz, (char *)p->mass, (char *)p->radius, (char *)p->color, (char *)p->selected, (char *)pathArena};
+	size_t sizes[CHECKPOINTSECTIONS] = {n * sizeof(double), n * sizeof(double), n * sizeof(double), n * sizeof(double), n * sizeof(double), n * sizeof(double), n * sizeof(double), n * sizeof(double), n * sizeof(vector), n * sizeof(short), 3 * n * maxPathLength * sizeof(float)};
+	memset(h, 0, sizeof(checkpointHeader));
+	memcpy(h->magic, "UNIVERSE", 8);
+	h->version = CHECKPOINTVERSION;
+	h->bodies = sampleSize;
+	h->pathPoints = maxPathLength;
+	h->pathHead = pathHead;
+	h->pathLength = pathLength;
+	h->sections = CHECKPOINTSECTIONS;
+	h->steps = stepCount;
+	for (i=0; i<CHECKPOINTSECTIONS; i++) {
+		data[i] = arrays[i];
+		h->size[i] = sizes[i];
+		h->offset[i] = offset;
+		offset += (sizes[i] + CHECKPOINTALIGN - 1) / CHECKPOINTALIGN * CHECKPOINTALIGN;
+	}
+}
+
+
+int writeAll(int fd, char *data, size_t size, off_t offset) {
+	ssize_t done = 0;
+	while (size > 0) {
+		done = pwrite(fd, data, size, offset);
+		if (done <= 0) {
+			return(0);
+		}
+		data += done;
+		size -= done;
+		offset += done;
+	}
+	return(1);
+}
+
+
+void writeCheckpoint(char *tmpName) {
+	// forked child: only system calls, the other threads of the parent may
+	// have held the malloc or stdio locks at the fork
+	checkpointHeader h;
+	char *data[CHECKPOINTSECTIONS];
+	int i = 0,
+		ok = 1,
+		fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		_exit(EXIT_FAILURE);
+	}
+	checkpointLayout(&h, data);
+	for (i=0; i<CHECKPOINTSECTIONS; i++) {
+		ok &= writeAll(fd, data[i], h.size[i], h.offset[i]);
+	}
+	// the header goes last and the file is renamed once on disk, a crash
+	// leaves the previous checkpoint intact
+	ok &= writeAll(fd, (char *)&h, sizeof(h), 0);
+	ok &= (fsync(fd) == 0);
+	ok &= (close(fd) == 0);
+	if (!ok || (rename(tmpName, checkpointName) != 0)) {
+		_exit(EXIT_FAILURE);
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+
+void reportCheckpoint(int status) {
+	if (WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS)) {
+		printf("INFO: checkpoint of step %ld saved to %s\n", checkpointSteps, checkpointName);
+	} else {
+		printf("INFO: checkpoint of step %ld failed\n", checkpointSteps);
+	}
+	checkpointWriter = 0;
+}
+
+
+void saveCheckpoint(void) {
+	// called by the sim thread between two steps, only the fork pauses it
+	char tmpName[256];
+	int status = 0;
+	pid_t pid = 0;
+	if (checkpointWriter > 0) {
+		if (waitpid(checkpointWriter, &status, WNOHANG) == 0) {
+			printf("INFO: checkpoint of step %ld still written, step %ld skipped\n", checkpointSteps, stepCount);
+			return;
+		}
+		reportCheckpoint(status);
+	}
+	snprintf(tmpName, sizeof(tmpName), "%s.tmp", checkpointName);
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0) {
+		writeCheckpoint(tmpName);
+	}
+	if (pid < 0) {
+		printf("INFO: cannot fork the checkpoint writer of step %ld\n", stepCount);
+		return;
+	}
+	checkpointWriter = pid;
+	checkpointSteps = stepCount;
+}
+
+
+void finishCheckpoint(void) {
+	int status = 0;
+	if ((checkpointWriter > 0) && (waitpid(checkpointWriter, &status, 0) == checkpointWriter)) {
+		reportCheckpoint(status);
+	}
+}
+
+
+void openTrajectory(void) {
+	trajectory = fopen(trajectoryName, "wb");
+	if (trajectory == NULL) {
+		printf("ERROR: cannot write the trajectory to %s\n", trajectoryName);
+		exit(EXIT_FAILURE);
+	}
+}
+
+
+void putLittle(unsigned char *b, uint64_t v, int n) {
+	int i = 0;
+	for (i=0; i<n; i++) {
+		b[i] = (v >> (8 * i)) & 0xff;
+	}
+}
+
+
+uint64_t getLittle(unsigned char *b, int n) {
+	uint64_t v = 0;
+	int i = 0;
+	for (i=n-1; i>=0; i--) {
+		v = (v << 8) | b[i];
+	}
+	return(v);
+}
+
+
+void packTrajectoryHeader(trajectoryHeader *h, unsigned char *b) {
+	uint64_t bits = 0;
+	memcpy(b, h->magic, 8);
+	putLittle(&b[8], h->version, 4);
+	putLittle(&b[12], h->bodies, 4);
+	putLittle(&b[16], h->chunkSteps, 4);
+	putLittle(&b[20], h->columns, 4);
+	memcpy(&bits, &h->positionQuantum, 8);
+	putLittle(&b[24], bits, 8);
+	memcpy(&bits, &h->velocityQuantum, 8);
+	putLittle(&b[32], bits, 8);
+}
+
+
+void unpackTrajectoryHeader(unsigned char *b, trajectoryHeader *h) {
+	uint64_t bits = 0;
+	memcpy(h->magic, b, 8);
+	h->version = getLittle(&b[8], 4);
+	h->bodies = getLittle(&b[12], 4);
+	h->chunkSteps = getLittle(&b[16], 4);
+	h->columns = getLittle(&b[20], 4);
+	bits = getLittle(&b[24], 8);
+	memcpy(&h->positionQuantum, &bits, 8);
+	bits = getLittle(&b[32], 8);
+	memcpy(&h->velocityQuantum, &bits, 8);
+}
+
+
+void packTrajectoryChunk(trajectoryChunk *chunk, unsigned char *b) {
+	int c = 0;
+	putLittle(b, chunk->firstStep, 8);
+	putLittle(&b[8], chunk->steps, 4);
+	putLittle(&b[12], 0, 4);
+	for (c=0; c<6; c++) {
+		putLittle(&b[16+8*c], chunk->size[c], 8);
+	}
+}
+
+
+void unpackTrajectoryChunk(unsigned char *b, trajectoryChunk *chunk) {
+	int c = 0;
+	chunk->firstStep = getLittle(b, 8);
+	chunk->steps = getLittle(&b[8], 4);
+	chunk->reserved = 0;
+	for (c=0; c<6; c++) {
+		chunk->size[c] = getLittle(&b[16+8*c], 8);
+	}
+}
+
+
+void deflateColumn(z_stream *z, unsigned char *data, size_t size, int flush, unsigned char **out, size_t *capacity) {
+	// appends to the compressed column, the buffer grows as needed
+	z->next_in = data;
+	z->avail_in = size;
+	do {
+		if (z->total_out + 65536 > *capacity) {
+			*capacity = 2 * *capacity + 65536;
+			*out = realloc(*out, *capacity);
+		}
+		z->next_out = *out + z->total_out;
+		z->avail_out = *capacity - z->total_out;
+	} while ((deflate(z, flush) != Z_STREAM_END) && ((z->avail_in > 0) || (z->avail_out == 0) || (flush == Z_FINISH)));
+}
+
+
+void writeTrajectoryChunk(z_stream *z, unsigned char **out, size_t *capacity, long firstStep, int steps) {
+	trajectoryChunk chunk;
+	unsigned char b[TRAJECTORYBLOCK];
+	int c = 0;
+	memset(&chunk, 0, sizeof(chunk));
+	chunk.firstStep = firstStep;
+	chunk.steps = steps;
+	for (c=0; c<6; c++) {
+		deflateColumn(&z[c], NULL, 0, Z_FINISH, &out[c], &capacity[c]);
+		chunk.size[c] = z[c].total_out;
+	}
+	packTrajectoryChunk(&chunk, b);
+	fwrite(b, 1, TRAJECTORYBLOCK, trajectory);
+	trajectoryBytes += TRAJECTORYBLOCK;
+	for (c=0; c<6; c++) {
+		fwrite(out[c], 1, chunk.size[c], trajectory);
+		trajectoryBytes += chunk.size[c];
+		deflateReset(&z[c]);
+	}
+	fflush(trajectory);
+}
+
+
+void *trajectoryWorker(void *arg) {
+	// background writer: quantizes, predicts and compresses the queued steps
+	z_stream z[6];
+	unsigned char *out[6],
+		*varints = malloc(10 * (size_t)sampleSize),
+		*v = NULL;
+	size_t capacity[6];
+	long *previous = alignedArray(6 * sampleSize, sizeof(long)),
+		*last = NULL,
+		q = 0,
+		r = 0,
+		firstStep = 0;
+	unsigned long zigzag = 0;
+	double *column = NULL,
+		scale = 0.0;
+	int c = 0,
+		i = 0,
+		k = 0,
+		slot = 0,
+		steps = 0;
+	(void)arg;
+	for (c=0; c<6; c++) {
+		memset(&z[c], 0, sizeof(z_stream));
+		deflateInit(&z[c], 1);
+		out[c] = NULL;
+		capacity[c] = 0;
+	}
+	for (;;) {
+		pthread_mutex_lock(&trajectoryMutex);
+		while ((trajectoryCount == 0) && !trajectoryClosing) {
+			pthread_cond_wait(&trajectoryWake, &trajectoryMutex);
+		}
+		if (trajectoryCount == 0) {
+			pthread_mutex_unlock(&trajectoryMutex);
+			break;
+		}
+		slot = trajectoryHead;
+		pthread_mutex_unlock(&trajectoryMutex);
+		if (steps == 0) {
+			firstStep = trajectoryStep[slot];
+		}
+		// velocities first, the positions are predicted with the current ones
+		for (k=0; k<6; k++) {
+			c = (k + 3) % 6;
+			column = trajectoryColumns[slot][c];
+			last = &previous[(size_t)c * sampleSize];
+			scale = ldexp(1.0, (c < 3) ? 10 : 10 + TRAJECTORYSHIFT);
+			v = varints;
+			for (i=0; i<sampleSize; i++) {
+				q = llround(column[i] * scale);
+				r = q;
+				if (steps > 0) {
+					r -= last[i];
+					if (c < 3) {
+						r -= (previous[(size_t)(c + 3) * sampleSize + i] + (1 << (TRAJECTORYSHIFT - 1))) >> TRAJECTORYSHIFT;
+					}
+				}
+				last[i] = q;
+				zigzag = ((unsigned long)r << 1) ^ (unsigned long)(r >> 63);
+				while (zigzag >= 0x80) {
+					*v++ = (zigzag & 0x7f) | 0x80;
+					zigzag >>= 7;
+				}
+				*v++ = zigzag;
+			}
+			deflateColumn(&z[c], varints, v - varints, Z_NO_FLUSH, &out[c], &capacity[c]);
+		}
+		pthread_mutex_lock(&trajectoryMutex);
+		trajectoryHead = (trajectoryHead + 1) % TRAJECTORYQUEUE;
+		trajectoryCount--;
+		pthread_cond_signal(&trajectoryRoom);
+		pthread_mutex_unlock(&trajectoryMutex);
+		trajectoryWritten++;
+		if (++steps == TRAJECTORYCHUNK) {
+			writeTrajectoryChunk(z, out, capacity, firstStep, steps);
+			steps = 0;
+		}
+	}
+	if (steps > 0) {
+		writeTrajectoryChunk(z, out, capacity, firstStep, steps);
+	}
+	for (c=0; c<6; c++) {
+		deflateEnd(&z[c]);
+		free(out[c]);
+	}
+	free(varints);
+	return(NULL);
+}
+
+
+void queueTrajectory(void) {
+	// sim thread side, the step is only copied
+	double *columns[6] = {objectsList->x, objectsList->y, objectsList->z, objectsList->vx, objectsList->vy, objectsList->vz};
+	int c = 0,
+		slot = 0;
+	pthread_mutex_lock(&trajectoryMutex);
+	while ((trajectoryCount == TRAJECTORYQUEUE) && !trajectoryClosing) {
+		pthread_cond_wait(&trajectoryRoom, &trajectoryMutex);
+	}
+	if (trajectoryClosing) {
+		pthread_mutex_unlock(&trajectoryMutex);
+		return;
+	}
+	slot = (trajectoryHead + trajectoryCount) % TRAJECTORYQUEUE;
+	pthread_mutex_unlock(&trajectoryMutex);
+	// the writer does not read a slot before it is counted
+	for (c=0; c<6; c++) {
+		memcpy(trajectoryColumns[slot][c], columns[c], sampleSize * sizeof(double));
+	}
+	trajectoryStep[slot] = stepCount;
+	pthread_mutex_lock(&trajectoryMutex);
+	trajectoryCount++;
+	pthread_cond_signal(&trajectoryWake);
+	pthread_mutex_unlock(&trajectoryMutex);
+}
+
+
+void startTrajectory(void) {
+	// writes the header and the current step, called once the bodies are set
+	trajectoryHeader h;
+	unsigned char b[TRAJECTORYHEADER];
+	int c = 0,
+		i = 0;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "TRAJECTO", 8);
+	h.version = TRAJECTORYVERSION;
+	h.bodies = sampleSize;
+	h.chunkSteps = TRAJECTORYCHUNK;
+	h.columns = 6;
+	h.positionQuantum = ldexp(1.0, -10);
+	h.velocityQuantum = ldexp(1.0, -10 - TRAJECTORYSHIFT);
+	packTrajectoryHeader(&h, b);
+	fwrite(b, 1, TRAJECTORYHEADER, trajectory);
+	trajectoryBytes = TRAJECTORYHEADER;
+	for (i=0; i<TRAJECTORYQUEUE; i++) {
+		for (c=0; c<6; c++) {
+			trajectoryColumns[i][c] = alignedArray(sampleSize, sizeof(double));
+		}
+	}
+	if (pthread_create(&trajectoryThread, NULL, trajectoryWorker, NULL)) {
+		printf("ERROR: unable to start the trajectory thread\n");
+		exit(EXIT_FAILURE);
+	}
+	queueTrajectory();
+}
+
+
+void finishTrajectory(void) {
+	// the queued steps are written, later ones are dropped
+	pthread_mutex_lock(&trajectoryMutex);
+	trajectoryClosing = 1;
+	pthread_cond_broadcast(&trajectoryWake);
+	pthread_cond_broadcast(&trajectoryRoom);
+	pthread_mutex_unlock(&trajectoryMutex);
+	pthread_join(trajectoryThread, NULL);
+	fclose(trajectory);
+	trajectory = NULL;
+	printf("INFO: %d steps written to %s, %.2f bytes per body and step\n", trajectoryWritten, trajectoryName, (double)trajectoryBytes / ((double)trajectoryWritten * sampleSize));
+}
+
+
+unsigned char *inflateColumn(unsigned char *in, size_t size, size_t *outSize) {
+	z_stream z;
+	unsigned char *out = NULL;
+	size_t capacity = 0;
+	int status = Z_OK;
+	memset(&z, 0, sizeof(z));
+	inflateInit(&z);
+	z.next_in = in;
+	z.avail_in = size;
+	while (status == Z_OK) {
+		if (z.total_out + 65536 > capacity) {
+			capacity = 2 * capacity + 65536;
+			out = realloc(out, capacity);
+		}
+		z.next_out = out + z.total_out;
+		z.avail_out = capacity - z.total_out;
+		status = inflate(&z, Z_NO_FLUSH);
+	}
+	*outSize = z.total_out;
+	inflateEnd(&z);
+	if (status != Z_STREAM_END) {
+		free(out);
+		return(NULL);
+	}
+	return(out);
+}
+
+
+FILE *openTrajectoryFile(char *name, trajectoryHeader *h) {
+	unsigned char b[TRAJECTORYHEADER];
+	FILE *fp = fopen(name, "rb");
+	if ((fp == NULL) || (fread(b, 1, TRAJECTORYHEADER, fp) != TRAJECTORYHEADER)) {
+		printf("ERROR: cannot read the trajectory %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+	unpackTrajectoryHeader(b, h);
+	if (memcmp(h->magic, "TRAJECTO", 8) || (h->version != TRAJECTORYVERSION) || (h->columns != 6)) {
+		printf("ERROR: %s is not a trajectory of version %d\n", name, TRAJECTORYVERSION);
+		exit(EXIT_FAILURE);
+	}
+	return(fp);
+}
+
+
+int readTrajectoryChunk(FILE *fp, trajectoryHeader *h, long *current, int mode) {
+	// mode 0 skips the block, 1 decodes it into current, the quantized last
+	// step, and 2 also prints every step; returns the steps of the block, 0
+	// at the end of the file and -1 for a damaged block
+	trajectoryChunk chunk;
+	unsigned char b[TRAJECTORYBLOCK],
+		*packed = NULL,
+		*column[6],
+		*cursor[6],
+		*end[6];
+	size_t size = 0;
+	long q = 0,
+		skip = 0,
+		*last = NULL;
+	uint64_t zigzag = 0;
+	int c = 0,
+		i = 0,
+		k = 0,
+		s = 0,
+		shift = 0,
+		ok = 1,
+		n = h->bodies;
+	if (fread(b, 1, TRAJECTORYBLOCK, fp) != TRAJECTORYBLOCK) {
+		return(0);
+	}
+	unpackTrajectoryChunk(b, &chunk);
+	if (mode == 0) {
+		for (c=0; c<6; c++) {
+			skip += chunk.size[c];
+		}
+		return(fseek(fp, skip, SEEK_CUR) == 0 ? chunk.steps : -1);
+	}
+	for (c=0; c<6; c++) {
+		packed = malloc(chunk.size[c]);
+		column[c] = NULL;
+		size = 0;
+		if (fread(packed, 1, chunk.size[c], fp) == (size_t)chunk.size[c]) {
+			column[c] = inflateColumn(packed, chunk.size[c], &size);
+		}
+		free(packed);
+		ok &= (column[c] != NULL);
+		cursor[c] = column[c];
+		end[c] = column[c] + size;
+	}
+	for (s=0; ok && (s<chunk.steps); s++) {
+		// velocities first, the positions are predicted with the current ones
+		for (k=0; ok && (k<6); k++) {
+			c = (k + 3) % 6;
+			last = &current[(size_t)c * n];
+			for (i=0; i<n; i++) {
+				zigzag = 0;
+				shift = 0;
+				do {
+					if ((cursor[c] == end[c]) || (shift > 63)) {
+						ok = 0;
+						break;
+					}
+					zigzag |= (uint64_t)(*cursor[c] & 0x7f) << shift;
+					shift += 7;
+				} while (*cursor[c]++ & 0x80);
+				q = (long)(zigzag >> 1) ^ -(long)(zigzag & 1);
+				if (s > 0) {
+					q += last[i];
+					if (c < 3) {
+						q += (current[(size_t)(c + 3) * n + i] + (1 << (TRAJECTORYSHIFT - 1))) >> TRAJECTORYSHIFT;
+					}
+				}
+				last[i] = q;
+			}
+		}
+		for (i=0; ok && (mode == 2) && (i<n); i++) {
+			fprintf(dumpOutput, "%ld %d %.17g %.17g %.17g %.17g %.17g %.17g\n", chunk.firstStep + s, i,
+				current[i] * h->positionQuantum, current[n+i] * h->positionQuantum, current[2*n+i] * h->positionQuantum,
+				current[3*n+i] * h->velocityQuantum, current[4*n+i] * h->velocityQuantum, current[5*n+i] * h->velocityQuantum);
+		}
+	}
+	for (c=0; c<6; c++) {
+		ok &= (cursor[c] == end[c]);
+		free(column[c]);
+	}
+	return(ok ? chunk.steps : -1);
+}
+
+
+void dumpTrajectory(void) {
+	// -X prints every step of a trajectory as text, one body per line
+	trajectoryHeader h;
+	FILE *fp = openTrajectoryFile(dumpName, &h);
+	long *current = malloc(6 * (size_t)h.bodies * sizeof(long)),
+		steps = 0;
+	int n = 0;
+	fprintf(dumpOutput, "# step body x y z vx vy vz\n");
+	while ((n = readTrajectoryChunk(fp, &h, current, 2)) > 0) {
+		steps += n;
+	}
+	fclose(fp);
+	fclose(dumpOutput);
+	if (n < 0) {
+		printf("ERROR: damaged block after step %ld of %s\n", steps, dumpName);
+		exit(EXIT_FAILURE);
+	}
+	printf("INFO: %ld steps of %d bodies read from %s\n", steps, h.bodies, dumpName);
+}
+
+
+void checkTrajectory(void) {
+	// the batch mode reads its last block back and compares it with the state
+	trajectoryHeader h;
+	FILE *fp = openTrajectoryFile(trajectoryName, &h);
+	double *columns[6] = {objectsList->x, objectsList->y, objectsList->z, objectsList->vx, objectsList->vy, objectsList->vz};
+	double error[2] = {0.0, 0.0};
+	long *current = malloc(6 * (size_t)sampleSize * sizeof(long)),
+		offset = ftell(fp),
+		lastOffset = offset;
+	int c = 0,
+		i = 0,
+		n = 0;
+	while ((n = readTrajectoryChunk(fp, &h, current, 0)) > 0) {
+		lastOffset = offset;
+		offset = ftell(fp);
+	}
+	fseek(fp, lastOffset, SEEK_SET);
+	if ((n < 0) || (h.bodies != sampleSize) || (readTrajectoryChunk(fp, &h, current, 1) <= 0)) {
+		printf("ERROR: %s cannot be read back\n", trajectoryName);
+		exit(EXIT_FAILURE);
+	}
+	for (c=0; c<6; c++) {
+		for (i=0; i<sampleSize; i++) {
+			error[c >= 3] = fmax(error[c >= 3], fabs(current[(size_t)c * sampleSize + i] * ((c < 3) ? h.positionQuantum : h.velocityQuantum) - columns[c][i]));
+		}
+	}
+	printf("INFO: last step read back from %s within %g of the positions and %g of the velocities\n", trajectoryName, error[0], error[1]);
+	free(current);
+	fclose(fp);
+}
+
+
+void openDump(char *name) {
+	// the text goes to the standard output, messages to stderr
+	dumpName = name;
+	dumpOutput = fdopen(dup(STDOUT_FILENO), "w");
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+}
+
+
+char* displayObject(int o, int simple) {
+	char *text = NULL;
+	snapshot *p = view;
+	text = calloc(120, sizeof(text));
+	if (simple) {
+		sprintf(text, "[%d] coord: (%.2f, %.2f, %.2f)", o, p->x[o], p->y[o], p->z[o]);
+	} else {
+		sprintf(text, "[%d] coord: (%.2f, %.2f, %.2f) velocity: (%.2f, %.2f, %.2f)\n", o, p->x[o], p->y[o], p->z[o], p->vx[o], p->vy[o], p->vz[o]);
+	}
+	return(text);
+}
+
+
+GLuint compileShader(GLenum type, const char *source) {
+	GLuint shader = glCreateShader(type);
+	GLint status = 0;
+	char log[512];
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (!status) {
+		glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+		printf("INFO: sphere shader rejected: %s\n", log);
+		glDeleteShader(shader);
+		return(0);
+	}
+	return(shader);
+}
+
+
+void initSpheres(void) {
+	int st=0, sl=0, n=0;
+	double theta=0.0, phi=0.0;
+	float *vertices = NULL;
+	GLuint *indices = NULL,
+		vertex = 0,
+		fragment = 0;
+	GLint status = 0;
+	const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+	sphereList = glGenLists(1);
+	glNewList(sphereList, GL_COMPILE);
+	glutSolidSphere(1.0, SPHERESTEPS, SPHERESTEPS);
+	glEndList();
+	if ((extensions == NULL) || !strstr(extensions, "GL_ARB_instanced_arrays") || !strstr(extensions, "GL_ARB_draw_instanced") || !strstr(extensions, "GL_ARB_shading_language_100")) {
+		printf("INFO: instancing unavailable, spheres are drawn one by one\n");
+		return;
+	}
+	vertex = compileShader(GL_VERTEX_SHADER, sphereVertexShader);
+	fragment = compileShader(GL_FRAGMENT_SHADER, sphereFragmentShader);
+	if (!vertex || !fragment) {
+		return;
+	}
+	sphereProgram = glCreateProgram();
+	glAttachShader(sphereProgram, vertex);
+	glAttachShader(sphereProgram, fragment);
+	glLinkProgram(sphereProgram);
+	glGetProgramiv(sphereProgram, GL_LINK_STATUS, &status);
+	if (!status) {
+		printf("INFO: sphere program rejected, spheres are drawn one by one\n");
+		glDeleteProgram(sphereProgram);
+		sphereProgram = 0;
+		return;
+	}
+	sphereVertex = glGetAttribLocation(sphereProgram, "vertex");
+	sphereInstance = glGetAttribLocation(sphereProgram, "instance");
+	sphereTint = glGetAttribLocation(sphereProgram, "tint");
+
+	// unit sphere by stacks from the +z pole, triangles wound counterclockwise seen from outside
+	vertices = calloc(3 * (SPHERESTEPS + 1) * (SPHERESTEPS + 1), sizeof(float));
+	indices = calloc(6 * SPHERESTEPS * SPHERESTEPS, sizeof(GLuint));
+	for (st=0; st<=SPHERESTEPS; st++) {
+		theta = pi * st / SPHERESTEPS;
+		for (sl=0; sl<=SPHERESTEPS; sl++) {
+			phi = 2.0 * pi * sl / SPHERESTEPS;
+			n = 3 * (st * (SPHERESTEPS + 1) + sl);
+			vertices[n] = sin(theta) * cos(phi);
+			vertices[n+1] = sin(theta) * sin(phi);
+			vertices[n+2] = cos(theta);
+		}
+	}
+	for (st=0; st<SPHERESTEPS; st++) {
+		for (sl=0; sl<SPHERESTEPS; sl++) {
+			n = st * (SPHERESTEPS + 1) + sl;
+			indices[sphereIndices++] = n;
+			indices[sphereIndices++] = n + SPHERESTEPS + 1;
+			indices[sphereIndices++] = n + 1;
+			indices[sphereIndices++] = n + 1;
+			indices[sphereIndices++] = n + SPHERESTEPS + 1;
+			indices[sphereIndices++] = n + SPHERESTEPS + 2;
+		}
+	}
+	glGenBuffers(3, sphereBuffers);
+	glBindBuffer(GL_ARRAY_BUFFER, sphereBuffers[0]);
+	glBufferData(GL_ARRAY_BUFFER, 3 * (SPHERESTEPS + 1) * (SPHERESTEPS + 1) * sizeof(float), vertices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sphereBuffers[1]);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sphereIndices * sizeof(GLuint), indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	free(vertices);
+	free(indices);
+	instanceData = alignedArray(7 * sampleSize, sizeof(float));
+	printf("INFO: spheres drawn with instancing\n");
+}
+
+
+void drawObject(int o) {
+	glPushMatrix();
+	glTranslatef(view->x[o], view->y[o], view->z[o]);
+	if (view->selected[o]) {
+		glColor3f(1.0, 0.0, 0.0);
+		glutWireCube(view->radius[o] * 2.0);
+	}
+	glColor3f(view->color[o].x, view->color[o].y, view->color[o].z);
+	glScalef(view->radius[o], view->radius[o], view->radius[o]);
+	glCallList(sphereList);
+	glPopMatrix();
+}
+
+
+void drawSpheres(void) {
+	// one instanced draw for all the bodies
+	int i = 0;
+	float *d = NULL;
+	if (!sphereProgram) {
+		for (i=0; i<sampleSize; i++) {
+			drawObject(i);
+		}
+		return;
+	}
+	for (i=0; i<sampleSize; i++) {
+		d = &instanceData[7*i];
+		d[0] = view->x[i]; d[1] = view->y[i]; d[2] = view->z[i];
+		d[3] = view->radius[i];
+		d[4] = view->color[i].x; d[5] = view->color[i].y; d[6] = view->color[i].z;
+	}
+	glUseProgram(sphereProgram);
+	glBindBuffer(GL_ARRAY_BUFFER, sphereBuffers[0]);
+	glEnableVertexAttribArray(sphereVertex);
+	glVertexAttribPointer(sphereVertex, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+	glBindBuffer(GL_ARRAY_BUFFER, sphereBuffers[2]);
+	// orphaning the store lets the driver keep drawing the previous frame
+	glBufferData(GL_ARRAY_BUFFER, 7 * sampleSize * sizeof(float), NULL, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, 7 * sampleSize * sizeof(float), instanceData);
+	glEnableVertexAttribArray(sphereInstance);
+	glVertexAttribPointer(sphereInstance, 4, GL_FLOAT, GL_FALSE, 7 * sizeof(float), NULL);
+	glVertexAttribDivisorARB(sphereInstance, 1);
+	glEnableVertexAttribArray(sphereTint);
+	glVertexAttribPointer(sphereTint, 3, GL_FLOAT, GL_FALSE, 7 * sizeof(float), (void *)(4 * sizeof(float)));
+	glVertexAttribDivisorARB(sphereTint, 1);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sphereBuffers[1]);
+	glDrawElementsInstancedARB(GL_TRIANGLES, sphereIndices, GL_UNSIGNED_INT, NULL, sampleSize);
+	glVertexAttribDivisorARB(sphereInstance, 0);
+	glVertexAttribDivisorARB(sphereTint, 0);
+	glDisableVertexAttribArray(sphereVertex);
+	glDisableVertexAttribArray(sphereInstance);
+	glDisableVertexAttribArray(sphereTint);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glUseProgram(0);
+	for (i=0; i<sampleSize; i++) {
+		if (view->selected[i]) {
+			glPushMatrix();
+			glTranslatef(view->x[i], view->y[i], view->z[i]);
+			glColor3f(1.0, 0.0, 0.0);
+			glutWireCube(view->radius[i] * 2.0);
+			glPopMatrix();
+		}
+	}
+}
+
+
+void initTrails(void) {
+	int o = 0,
+		s = 0;
+	size_t n = 0;
+	GLuint *indices = calloc((size_t)maxPathLength * sampleSize, sizeof(GLuint));
+	for (o=0; o<sampleSize; o++) {
+		for (s=0; s<maxPathLength; s++) {
+			indices[n++] = s * sampleSize + o;
+		}
+	}
+	glGenBuffers(3, trailBuffers);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, trailBuffers[2]);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, n * sizeof(GLuint), indices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	free(indices);
+	glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[0]);
+	glBufferData(GL_ARRAY_BUFFER, 3 * (size_t)maxPathLength * sampleSize * sizeof(float), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[1]);
+	glBufferData(GL_ARRAY_BUFFER, 3 * (size_t)maxPathLength * sampleSize, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	trailColors = alignedArray(3 * sampleSize, sizeof(unsigned char));
+}
+
+
+void updateTrails(void) {
+	// called every frame after the snapshot is taken, it holds the points of
+	// the steps after trailSteps and they are sent from there
+	int i = 0,
+		s = 0,
+		slot = 0,
+		fresh = view->steps - trailSteps < view->pathLength ? view->steps - trailSteps : view->pathLength;
+	size_t size = 3 * (size_t)sampleSize;
+	if (fresh > view->steps - view->trailFirst + 1) {
+		fresh = view->steps - view->trailFirst + 1;
+	}
+	if (fresh <= 0) {
+		return;
+	}
+	for (i=0; i<sampleSize; i++) {
+		trailColors[3*i] = (unsigned char)(255.0 * fmin(fmax(view->color[i].x, 0.0), 1.0));
+		trailColors[3*i+1] = (unsigned char)(255.0 * fmin(fmax(view->color[i].y, 0.0), 1.0));
+		trailColors[3*i+2] = (unsigned char)(255.0 * fmin(fmax(view->color[i].z, 0.0), 1.0));
+	}
+	for (s=0; s<fresh; s++) {
+		slot = (view->pathHead - s + maxPathLength) % maxPathLength;
+		glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[0]);
+		glBufferSubData(GL_ARRAY_BUFFER, slot * size * sizeof(float), size * sizeof(float), &view->trail[slot * size]);
+		glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[1]);
+		glBufferSubData(GL_ARRAY_BUFFER, slot * size, size, trailColors);
+	}
+	trailSteps = view->steps;
+	atomic_store(&trailShown, trailSteps);
+}
+
+
+void drawTrails(void) {
+	// filled slots are contiguous until the ring is full, one draw covers them
+	int first = view->pathHead - view->pathLength + 1;
+	glPointSize(0.5f);
+	glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[0]);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, NULL);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glNormalPointer(GL_FLOAT, 0, NULL);
+	glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[1]);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glColorPointer(3, GL_UNSIGNED_BYTE, 0, NULL);
+	if (view->pathLength < maxPathLength) {
+		glDrawArrays(GL_POINTS, first * sampleSize, view->pathLength * sampleSize);
+	} else {
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, trailBuffers[2]);
+		glDrawElements(GL_POINTS, maxPathLength * sampleSize, GL_UNSIGNED_INT, NULL);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+void drawPath(int o) {
+	// the uploaded points of one body, contiguous in the body-major indices
+	// since the ring is filled from slot 0
+	glPointSize(0.5f);
+	glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[0]);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, NULL);
+	glEnableClientState(GL_NORMAL_ARRAY);
+	glNormalPointer(GL_FLOAT, 0, NULL);
+	glBindBuffer(GL_ARRAY_BUFFER, trailBuffers[1]);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glColorPointer(3, GL_UNSIGNED_BYTE, 0, NULL);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, trailBuffers[2]);
+	glDrawElements(GL_POINTS, view->pathLength, GL_UNSIGNED_INT, (GLvoid *)((size_t)o * maxPathLength * sizeof(GLuint)));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisableClientState(GL_NORMAL_ARRAY);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+void drawString(float x, float y, float z, char *text) {
+	unsigned i = 0;
+	glPushMatrix();
+	glLineWidth(1.0);
+	glColor3f(1.0, 1.0, 1.0); // Black background
+	glTranslatef(x, y, z);
+	glScalef(0.008, 0.008, 0.008);
+	for(i=0; i < strlen(text); i++) {
+		glutStrokeCharacter(GLUT_STROKE_MONO_ROMAN, (int)text[i]);
+	}
+	glPopMatrix();
+}
+
+
+void drawText(void) {
+	int i = 0;
+	char text1[50], text2[70], text3[120];
+	sprintf(text1, "Nbr of objects: %d", sampleSize);
+	sprintf(text2, "steps/s: %.1f, FPS: %4.2f", stepRate, fps);
+	for (i=0; i<sampleSize; i++) {
+		if (view->selected[i]) {
+			sprintf(text3, "%s", displayObject(i, 0));
+		}
+	}
+	textList = glGenLists(1);
+	glNewList(textList, GL_COMPILE);
+	drawString(-40.0, -36.0, -100.0, text1);
+	drawString(-40.0, -38.0, -100.0, text2);
+	drawString(-40.0, -40.0, -100.0, text3);
+	glEndList();
+}
+
+
+void drawAxes(void) {
+	glPushMatrix();
+	glLineWidth(1.0);
+	glTranslatef(0.0, 0.0, 0.0);
+	glColor3f(0.4, 0.4, 0.4);
+	glutWireCube(100.0*3.0);
+	glPopMatrix();
+}
+
+
+void drawBox(void) {
+	glMatrixMode(GL_PROJECTION);
+	glPushMatrix();
+	glLoadIdentity();
+	gluOrtho2D(0, pickPort[2], 0, pickPort[3]);
+	glMatrixMode(GL_MODELVIEW);
+	glPushMatrix();
+	glLoadIdentity();
+	glDisable(GL_LIGHTING);
+	glDisable(GL_DEPTH_TEST);
+	glColor3f(1.0, 0.0, 0.0);
+	glBegin(GL_LINE_LOOP);
+	glVertex2i(boxX0, boxY0);
+	glVertex2i(boxX1, boxY0);
+	glVertex2i(boxX1, boxY1);
+	glVertex2i(boxX0, boxY1);
+	glEnd();
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_LIGHTING);
+	glPopMatrix();
+	glMatrixMode(GL_PROJECTION);
+	glPopMatrix();
+	glMatrixMode(GL_MODELVIEW);
+}
+
+
+void display(void) {
+	int i=0;
+	acquireSnapshot();
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+
+	drawText();
+	glCallList(textList);
+
+	glPushMatrix();
+	glTranslatef(xx, yy, -zoom);
+	glRotatef(rotx, 1.0, 0.0, 0.0);
+	glRotatef(roty, 0.0, 1.0, 0.0);
+	glRotatef(rotz, 0.0, 0.0, 1.0);
+	glGetDoublev(GL_MODELVIEW_MATRIX, pickModel);
+	glGetDoublev(GL_PROJECTION_MATRIX, pickProjection);
+	glGetIntegerv(GL_VIEWPORT, pickPort);
+
+	GLfloat ambient1[] = {0.15f, 0.15f, 0.15f, 1.0f};
+	GLfloat diffuse1[] = {0.8f, 0.8f, 0.8f, 1.0f};
+	GLfloat specular1[] = {1.0f, 1.0f, 1.0f, 1.0f};
+	GLfloat position1[] = {0.0f, 0.0f, 20.0f, 1.0f};
+	glLightfv(GL_LIGHT1, GL_AMBIENT, ambient1);
+	glLightfv(GL_LIGHT1, GL_DIFFUSE, diffuse1);
+	glLightfv(GL_LIGHT1, GL_DIFFUSE, specular1);
+	glLightfv(GL_LIGHT1, GL_POSITION, position1);
+	glEnable(GL_LIGHT1);
+
+	if (axe) { drawAxes(); }
+	drawSpheres();
+	updateTrails();
+	if (allTraces) {
+		drawTrails();
+	} else if (trace) {
+		for (i=0; i<sampleSize; i++) {
+			if (view->selected[i]) {
+				drawPath(i);
+			}
+		}
+	}
+	glPopMatrix();
+	if (boxActive) {
+		drawBox();
+	}
+	captureDisplay();
+
+	glutSwapBuffers();
+	glutPostRedisplay();
+}
+
+
+void pickSelect(int first, int last, int nth, double *c) {
+	// reorders pickIndex so that nth holds the median along c of the range
+	int i=0, j=0, t=0;
+	double pivot = 0.0;
+	while (last - first > 1) {
+		pivot = c[pickIndex[(first + last) / 2]];
+		i = first;
+		j = last - 1;
+		while (i <= j) {
+			while (c[pickIndex[i]] < pivot) {
+				i++;
+			}
+			while (c[pickIndex[j]] > pivot) {
+				j--;
+			}
+			if (i <= j) {
+				t = pickIndex[i]; pickIndex[i] = pickIndex[j]; pickIndex[j] = t;
+				i++;
+				j--;
+			}
+		}
+		if (nth <= j) {
+			last = j + 1;
+		} else if (nth >= i) {
+			first = i;
+		} else {
+			return;
+		}
+	}
+}
+
+
+void pickBuild(int node, int first, int last) {
+	// splits at the median center of the widest axis, the boxes bound the
+	// spheres of the leaves and are merged on the way up
+	int i=0, a=0, axis=0, o=0,
+		left = 2 * node + 1,
+		right = 2 * node + 2;
+	double *c[3] = {view->x, view->y, view->z},
+		*lo = &pickLo[3*node],
+		*hi = &pickHi[3*node],
+		low[3], high[3];
+	pickFirst[node] = first;
+	pickLast[node] = last;
+	if (last - first <= PICKLEAF) {
+		for (a=0; a<3; a++) {
+			lo[a] = HUGE_VAL;
+			hi[a] = -HUGE_VAL;
+			for (i=first; i<last; i++) {
+				o = pickIndex[i];
+				lo[a] = fmin(lo[a], c[a][o] - view->radius[o]);
+				hi[a] = fmax(hi[a], c[a][o] + view->radius[o]);
+			}
+		}
+		return;
+	}
+	for (a=0; a<3; a++) {
+		low[a] = c[a][pickIndex[first]];
+		high[a] = low[a];
+		for (i=first+1; i<last; i++) {
+			o = pickIndex[i];
+			low[a] = c[a][o] < low[a] ? c[a][o] : low[a];
+			high[a] = c[a][o] > high[a] ? c[a][o] : high[a];
+		}
+		if (high[a] - low[a] > high[axis] - low[axis]) {
+			axis = a;
+		}
+	}
+	pickSelect(first, last, (first + last) / 2, c[axis]);
+	pickBuild(left, first, (first + last) / 2);
+	pickBuild(right, (first + last) / 2, last);
+	for (a=0; a<3; a++) {
+		lo[a] = fmin(pickLo[3*left+a], pickLo[3*right+a]);
+		hi[a] = fmax(pickHi[3*left+a], pickHi[3*right+a]);
+	}
+}
+
+
+double pickBox(int node, double *origin, double *inverse) {
+	// distance along the ray to the node box, HUGE_VAL when missed
+	int a = 0;
+	double t0=0.0, t1=0.0, enter=0.0, leave=HUGE_VAL;
+	for (a=0; a<3; a++) {
+		t0 = (pickLo[3*node+a] - origin[a]) * inverse[a];
+		t1 = (pickHi[3*node+a] - origin[a]) * inverse[a];
+		enter = fmax(enter, fmin(t0, t1));
+		leave = fmin(leave, fmax(t0, t1));
+	}
+	return(enter <= leave ? enter : HUGE_VAL);
+}
+
+
+void pickSearch(int node, double *origin, double *dir, double *inverse, double *best, int *hit) {
+	int i=0, o=0;
+	double b=0.0, cc=0.0, disc=0.0, t=0.0, t1=0.0, t2=0.0, oc[3];
+	if (pickLast[node] - pickFirst[node] <= PICKLEAF) {
+		for (i=pickFirst[node]; i<pickLast[node]; i++) {
+			o = pickIndex[i];
+			oc[0] = origin[0] - view->x[o];
+			oc[1] = origin[1] - view->y[o];
+			oc[2] = origin[2] - view->z[o];
+			b = (oc[0] * dir[0]) + (oc[1] * dir[1]) + (oc[2] * dir[2]);
+			cc = (oc[0] * oc[0]) + (oc[1] * oc[1]) + (oc[2] * oc[2]) - (view->radius[o] * view->radius[o]);
+			disc = (b * b) - cc;
+			if (disc >= 0) {
+				t = -b - sqrt(disc);
+				if ((t >= 0) && (t < *best)) {
+					*best = t;
+					*hit = o;
+				}
+			}
+		}
+		return;
+	}
+	t1 = pickBox(2 * node + 1, origin, inverse);
+	t2 = pickBox(2 * node + 2, origin, inverse);
+	if (t1 <= t2) {
+		if (t1 < *best) { pickSearch(2 * node + 1, origin, dir, inverse, best, hit); }
+		if (t2 < *best) { pickSearch(2 * node + 2, origin, dir, inverse, best, hit); }
+	} else {
+		if (t2 < *best) { pickSearch(2 * node + 2, origin, dir, inverse, best, hit); }
+		if (t1 < *best) { pickSearch(2 * node + 1, origin, dir, inverse, best, hit); }
+	}
+}
+
+
+int pickObject(int x, int y) {
+	// nearest sphere under the window point (x, y), -1 when none
+	int i = 0,
+		hit = -1,
+		nodes = 1;
+	double best = HUGE_VAL,
+		length = 0.0,
+		origin[3], end[3], dir[3], inverse[3];
+	if (pickIndex == NULL) {
+		while (PICKLEAF * nodes < sampleSize) {
+			nodes *= 2;
+		}
+		nodes *= 2;
+		pickIndex = alignedArray(sampleSize, sizeof(int));
+		pickFirst = alignedArray(nodes, sizeof(int));
+		pickLast = alignedArray(nodes, sizeof(int));
+		pickLo = alignedArray(3 * nodes, sizeof(double));
+		pickHi = alignedArray(3 * nodes, sizeof(double));
+	}
+	if (pickSteps != view->steps) {
+		for (i=0; i<sampleSize; i++) {
+			pickIndex[i] = i;
+		}
+		pickBuild(0, 0, sampleSize);
+		pickSteps = view->steps;
+	}
+	gluUnProject(x, y, 0.0, pickModel, pickProjection, pickPort, &origin[0], &origin[1], &origin[2]);
+	gluUnProject(x, y, 1.0, pickModel, pickProjection, pickPort, &end[0], &end[1], &end[2]);
+	for (i=0; i<3; i++) {
+		dir[i] = end[i] - origin[i];
+		length += dir[i] * dir[i];
+	}
+	length = sqrt(length);
+	for (i=0; i<3; i++) {
+		dir[i] /= length;
+		inverse[i] = 1.0 / dir[i];
+	}
+	if (pickBox(0, origin, inverse) < best) {
+		pickSearch(0, origin, dir, inverse, &best, &hit);
+	}
+	return(hit);
+}
+
+
+void selectObject(int x, int y) {
+	int o = pickObject(x, y);
+	if (o >= 0) {
+		view->selected[o] = !view->selected[o];
+		printf("INFO: Touched -> %s", displayObject(o, 1));
+	}
+}
+
+
+void selectBox(void) {
+	// selects the planets whose center is drawn inside the dragged box
+	int i = 0,
+		nb = 0;
+	GLdouble wx=0.0, wy=0.0, wz=0.0;
+	for (i=0; i<sampleSize; i++) {
+		gluProject(view->x[i], view->y[i], view->z[i], pickModel, pickProjection, pickPort, &wx, &wy, &wz);
+		if ((wz > 0) && (wz < 1) && (wx >= fmin(boxX0, boxX1)) && (wx <= fmax(boxX0, boxX1)) && (wy >= fmin(boxY0, boxY1)) && (wy <= fmax(boxY0, boxY1))) {
+			view->selected[i] = 1;
+			nb++;
+		}
+	}
+	printf("INFO: %d planets selected in the box\n", nb);
+}
+
+
+void onReshape(int width, int height) {
+	glViewport(0, 0, width, height);
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	gluPerspective(45.0, width/height, 1.0, 1000.0);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+}
+
+
+void onSpecial(int key, int x, int y) {
+	switch (key) {
+		case GLUT_KEY_UP:
+			rotx += 5.0;
+			printf("INFO: x = %f\n", rotx);
+			break;
+		case GLUT_KEY_DOWN:
+			rotx -= 5.0;
+			printf("INFO: x = %f\n", rotx);
+			break;
+		case GLUT_KEY_LEFT:
+			rotz += 5.0;
+			printf("INFO: z = %f\n", rotz);
+			break;
+		case GLUT_KEY_RIGHT:
+			rotz -= 5.0;
+			printf("INFO: z = %f\n", rotz);
+			break;
+		default:
+			printf("x %d, y %d\n", x, y);
+			break;
+	}
+	glutPostRedisplay();
+}
+
+
+void onMotion(int x, int y) {
+	if (boxActive) {
+		boxX1 = x;
+		boxY1 = pickPort[3] - y;
+		glutPostRedisplay();
+		return;
+	}
+	if (prevx) {
+		xx += ((x - prevx)/10.0);
+		printf("INFO: x = %f\n", xx);
+	}
+	if (prevy) {
+		yy -= ((y - prevy)/10.0);
+		printf("INFO: y = %f\n", yy);
+	}
+	prevx = x;
+	prevy = y;
+	glutPostRedisplay();
+}
+
+
+void onIdle(void) {
+	frame += 1;
+	currentTime = glutGet(GLUT_ELAPSED_TIME);
+	if (currentTime - timebase >= 1000.0){
+		fps = frame*1000.0 / (currentTime-timebase);
+		stepRate = (view->steps - shownSteps) * 1000.0 / (currentTime-timebase);
+		shownSteps = view->steps;
+		timebase = currentTime;
+		frame = 0;
+	}
+	glutPostRedisplay();
+}
+
+
+void onMouse(int button, int state, int x, int y) {
+	switch (button) {
+		case GLUT_LEFT_BUTTON:
+			if (state == GLUT_DOWN) {
+				printf("INFO: left button, x %d, y %d\n", x, y);
+				selectObject(x, pickPort[3]-y);
+			}
+			break;
+		case GLUT_RIGHT_BUTTON:
+			if (state == GLUT_DOWN) {
+				printf("INFO: right button, x %d, y %d\n", x, y);
+				boxActive = 1;
+				boxX0 = boxX1 = x;
+				boxY0 = boxY1 = pickPort[3] - y;
+			} else if (boxActive) {
+				selectBox();
+				boxActive = 0;
+			}
+			break;
+	}
+}
+
+
+void onKeyboard(unsigned char key, int x, int y) {
+	char *name = malloc(20 * sizeof(char));
+	switch (key) {
+		case 27: // Escape
+			printf("INFO: exit\n");
+			stopSimulation();
+			finishCaptures();
+			if (trajectory != NULL) {
+				finishTrajectory();
+			}
+			finishCheckpoint();
+			printf("x %d, y %d\n", x, y);
+			exit(0);
+			break;
+		case 'x':
+			xx += 1.0;
+			printf("INFO: x = %f\n", xx);
+			break;
 		case 'X':
 			xx -= 1.0;
 			printf("INFO: x = %f\n", xx);
@@ -552,6 +2558,18 @@ void onKeyboard(unsigned char key, int x, int y) {
 			takeScreenshot(name);
 			cpt += 1;
 			break;
+		case 'c':
+			recording = !recording;
+			if (recording) {
+				if (video != NULL) {
+					printf("INFO: recording every frame to %s\n", videoName);
+				} else {
+					printf("INFO: recording every frame to record_*.png\n");
+				}
+			} else {
+				printf("INFO: %d frames recorded\n", recordCount);
+			}
+			break;
 		default:
 			break;
 	}
@@ -567,131 +2585,1481 @@ void onTimer(int event) {
 		default:
 			break;
 	}
-	if (rotate) {
-		rotz -= 0.2;
+	if (rotate) {
+		rotz -= 0.2;
+	} else {
+		rotz += 0.0;
+	}
+	if (rotz > 360) rotz = 360;
+	glutPostRedisplay();
+	glutTimerFunc(dt, onTimer, 0);
+}
+
+
+double getTime(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return(t.tv_sec + t.tv_nsec * 1.0e-9);
+}
+
+
+void runPoolTasks(void) {
+	// called with poolMutex held
+	int task = 0;
+	while (poolNext < poolTasks) {
+		task = poolNext++;
+		pthread_mutex_unlock(&poolMutex);
+		poolFunc(task);
+		pthread_mutex_lock(&poolMutex);
+		poolFinished++;
+	}
+	if (poolFinished == poolTasks) {
+		pthread_cond_broadcast(&poolDone);
+	}
+}
+
+
+void *poolWorker(void *arg) {
+	int generation = 0;
+	(void)arg;
+	pthread_mutex_lock(&poolMutex);
+	for (;;) {
+		while (generation == poolGeneration) {
+			pthread_cond_wait(&poolWake, &poolMutex);
+		}
+		generation = poolGeneration;
+		runPoolTasks();
+	}
+	return(NULL);
+}
+
+
+void initPool(void) {
+	int i = 0;
+	if (nbThreads < 1) {
+		nbThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (nbThreads < 1) {
+		nbThreads = 1;
+	}
+	workers = calloc(nbThreads, sizeof(pthread_t));
+	for (i=1; i<nbThreads; i++) {
+		if (pthread_create(&workers[i], NULL, poolWorker, NULL)) {
+			printf("ERROR: unable to start worker thread %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+
+void runTasks(int nbTasks, taskFunc func) {
+	pthread_mutex_lock(&poolMutex);
+	poolFunc = func;
+	poolTasks = nbTasks;
+	poolNext = 0;
+	poolFinished = 0;
+	poolGeneration++;
+	pthread_cond_broadcast(&poolWake);
+	runPoolTasks();
+	while (poolFinished < poolTasks) {
+		pthread_cond_wait(&poolDone, &poolMutex);
+	}
+	pthread_mutex_unlock(&poolMutex);
+}
+
+
+int gridCell(cellGrid *grid, vector p) {
+	int cx=0, cy=0, cz=0;
+	cx = (int)((p.x - grid->low.x) / grid->cellSize);
+	cy = (int)((p.y - grid->low.y) / grid->cellSize);
+	cz = (int)((p.z - grid->low.z) / grid->cellSize);
+	return((cx * grid->ny + cy) * grid->nz + cz);
+}
+
+
+void buildGrid(cellGrid *grid, double radius) {
+	// cells are at least radius wide so that neighbours lie in the 27 adjacent cells
+	int i=0, c=0, nbCells=0;
+	double extent=0.0;
+	vector high;
+	grid->low = getPos(objectsList, 0);
+	high = getPos(objectsList, 0);
+	for (i=0; i<sampleSize; i++) {
+		grid->low.x = fmin(grid->low.x, objectsList->x[i]);
+		grid->low.y = fmin(grid->low.y, objectsList->y[i]);
+		grid->low.z = fmin(grid->low.z, objectsList->z[i]);
+		high.x = fmax(high.x, objectsList->x[i]);
+		high.y = fmax(high.y, objectsList->y[i]);
+		high.z = fmax(high.z, objectsList->z[i]);
+	}
+	extent = fmax(fmax(high.x - grid->low.x, high.y - grid->low.y), high.z - grid->low.z);
+	// bound the number of cells for sparse systems
+	grid->cellSize = fmax(radius, extent / cbrt(4.0 * sampleSize));
+	grid->nx = (int)((high.x - grid->low.x) / grid->cellSize) + 1;
+	grid->ny = (int)((high.y - grid->low.y) / grid->cellSize) + 1;
+	grid->nz = (int)((high.z - grid->low.z) / grid->cellSize) + 1;
+	nbCells = grid->nx * grid->ny * grid->nz;
+	if (nbCells + 1 > grid->cellCapacity) {
+		grid->cellCapacity = nbCells + 1;
+		grid->cellStart = realloc(grid->cellStart, grid->cellCapacity * sizeof(int));
+	}
+	memset(grid->cellStart, 0, (nbCells + 1) * sizeof(int));
+	for (i=0; i<sampleSize; i++) {
+		c = gridCell(grid, getPos(objectsList, i));
+		grid->cell[i] = c;
+		grid->cellStart[c+1]++;
+	}
+	for (c=0; c<nbCells; c++) {
+		grid->cellStart[c+1] += grid->cellStart[c];
+	}
+	for (i=0; i<sampleSize; i++) {
+		c = grid->cellStart[grid->cell[i]]++;
+		grid->index[c] = i;
+		grid->x[c] = objectsList->x[i];
+		grid->y[c] = objectsList->y[i];
+		grid->z[c] = objectsList->z[i];
+		grid->mass[c] = objectsList->mass[i];
+		grid->xf[c] = grid->x[c];
+		grid->yf[c] = grid->y[c];
+		grid->zf[c] = grid->z[c];
+		grid->massf[c] = grid->mass[c];
+	}
+	// the scatter shifted every start by one cell
+	for (c=nbCells; c>0; c--) {
+		grid->cellStart[c] = grid->cellStart[c-1];
+	}
+	grid->cellStart[0] = 0;
+}
+
+
+int gridNeighbors(cellGrid *grid, vector p, int *first, int *last) {
+	// ranges of the bodies lying in the cells around p
+	int cx=0, cy=0, cz=0, x=0, y=0, z=0, c=0, nb=0;
+	cx = (int)((p.x - grid->low.x) / grid->cellSize);
+	cy = (int)((p.y - grid->low.y) / grid->cellSize);
+	cz = (int)((p.z - grid->low.z) / grid->cellSize);
+	for (x=cx-1; x<=cx+1; x++) {
+		if ((x < 0) | (x >= grid->nx)) { continue; }
+		for (y=cy-1; y<=cy+1; y++) {
+			if ((y < 0) | (y >= grid->ny)) { continue; }
+			// cells of a row are contiguous along z
+			z = (cz > 0) ? cz - 1 : 0;
+			c = (x * grid->ny + y) * grid->nz;
+			first[nb] = grid->cellStart[c + z];
+			z = (cz + 1 < grid->nz) ? cz + 1 : grid->nz - 1;
+			last[nb] = grid->cellStart[c + z + 1];
+			nb++;
+		}
+	}
+	return(nb);
+}
+
+
+vector meanColor(int o1) {
+	int o2 = 0,
+		k = 0,
+		r = 0,
+		nbRanges = 0,
+		numNeighbors = 0,
+		first[9], last[9];
+	double dist = 0,
+		dx=0.0, dy=0.0, dz=0.0;
+	vector sum;
+	sum.x=0.0; sum.y=0.0; sum.z=0.0;
+	nbRanges = gridNeighbors(&colorGrid, getPos(objectsList, o1), first, last);
+	for (r=0; r<nbRanges; r++) {
+		for (k=first[r]; k<last[r]; k++) {
+			dx = colorGrid.x[k] - objectsList->x[o1];
+			dy = colorGrid.y[k] - objectsList->y[o1];
+			dz = colorGrid.z[k] - objectsList->z[o1];
+			dist = sqrt((dx * dx) + (dy * dy) + (dz * dz));
+			if ((dist>0) & (dist < minDistance)) {
+				o2 = colorGrid.index[k];
+				sum = addVec(sum, objectsList->color[o2]);
+				numNeighbors++;
+			}
+		}
+	}
+	if (numNeighbors) {
+		sum = divVecByScalar(sum, numNeighbors);
+		sum = normalize(sum);
+	} else {
+		sum = objectsList->color[o1];
+	}
+	return(sum);
+}
+
+
+void keepWithinBounds1(int i) {
+	double highLimit = 150.0,
+		lowLimit = -150.0;
+	if ((nextList->x[i] >= highLimit) | (nextList->x[i] < lowLimit)) {
+		nextList->vx[i] = -1 * nextList->vx[i];
+	}
+	if ((nextList->y[i] >= highLimit) | (nextList->y[i] < lowLimit)) {
+		nextList->vy[i] = -1 * nextList->vy[i];
+	}
+	if ((nextList->z[i] >= highLimit) | (nextList->z[i] < lowLimit)) {
+		nextList->vz[i] = -1 * nextList->vz[i];
+	}
+}
+
+
+void keepWithinBounds2(int i) {
+	double highLimit = 150.0,
+		lowLimit = -150.0;
+	if (nextList->x[i] > highLimit) { nextList->x[i] = lowLimit; }
+	if (nextList->x[i] < lowLimit) { nextList->x[i] = highLimit; }
+	if (nextList->y[i] > highLimit) { nextList->y[i] = lowLimit; }
+	if (nextList->y[i] < lowLimit) { nextList->y[i] = highLimit; }
+	if (nextList->z[i] > highLimit) { nextList->z[i] = lowLimit; }
+	if (nextList->z[i] < lowLimit) { nextList->z[i] = highLimit; }
+}
+
+
+void pairForceScalar(vector pos, double gm, pairSource *s, int first, int last, vector *acc) {
+	// adds to acc the force of the sources [first, last) on a body of mass gm / g
+	int j = 0;
+	double force=0.0, r2=0.0,
+		dx=0.0, dy=0.0, dz=0.0;
+	for (j=first; j<last; j++) {
+		dx = s->x[j] - pos.x;
+		dy = s->y[j] - pos.y;
+		dz = s->z[j] - pos.z;
+		r2 = (dx * dx) + (dy * dy) + (dz * dz);
+		if ((r2 > 0) & (r2 < cutoffSquared)) {
+			force = (gm * s->mass[j]) / (r2 * sqrt(r2));
+			acc->x += force * dx;
+			acc->y += force * dy;
+			acc->z += force * dz;
+			if (s->fx) {
+				s->fx[j] -= force * dx;
+				s->fy[j] -= force * dy;
+				s->fz[j] -= force * dz;
+			}
+		}
+	}
+}
+
+
+void pairForceScalarFloat(vector pos, double gm, pairSource *s, int first, int last, vector *acc) {
+	// float32 version reading the float copies, sums stay in double
+	int j = 0;
+	float force=0.0, r2=0.0,
+		dx=0.0, dy=0.0, dz=0.0,
+		px = pos.x, py = pos.y, pz = pos.z,
+		fgm = gm,
+		limit = cutoffSquared;
+	for (j=first; j<last; j++) {
+		dx = s->xf[j] - px;
+		dy = s->yf[j] - py;
+		dz = s->zf[j] - pz;
+		r2 = (dx * dx) + (dy * dy) + (dz * dz);
+		if ((r2 > 0) & (r2 < limit)) {
+			force = (fgm * s->massf[j]) / (r2 * sqrtf(r2));
+			acc->x += force * dx;
+			acc->y += force * dy;
+			acc->z += force * dz;
+			if (s->fx) {
+				s->fx[j] -= force * dx;
+				s->fy[j] -= force * dy;
+				s->fz[j] -= force * dz;
+			}
+		}
+	}
+}
+
+
+#ifdef SIMD_KERNELS
+// the vector kernels seed 1/sqrt(r2) with the hardware estimate and refine it
+// with Newton steps y = y (1.5 - 0.5 r2 y^2), each one doubles the exact bits:
+// two steps give about 46 bits from the 12 bits rsqrtps, 52 from rsqrt14pd.
+// Out of range pairs are masked and the remainder goes to the scalar kernel.
+
+__attribute__((target("sse2")))
+void pairForceSse2(vector pos, double gm, pairSource *s, int first, int last, vector *acc) {
+	int j = first;
+	double sum[2];
+	__m128d px = _mm_set1_pd(pos.x),
+		py = _mm_set1_pd(pos.y),
+		pz = _mm_set1_pd(pos.z),
+		vgm = _mm_set1_pd(gm),
+		limit = _mm_set1_pd(cutoffSquared),
+		tiny = _mm_set1_pd(1.0e-30),
+		zero = _mm_setzero_pd(),
+		half = _mm_set1_pd(0.5),
+		threeHalves = _mm_set1_pd(1.5),
+		ax = zero, ay = zero, az = zero,
+		dx, dy, dz, r2, y, force, mask;
+	for (; j+2<=last; j+=2) {
+		dx = _mm_sub_pd(_mm_loadu_pd(&s->x[j]), px);
+		dy = _mm_sub_pd(_mm_loadu_pd(&s->y[j]), py);
+		dz = _mm_sub_pd(_mm_loadu_pd(&s->z[j]), pz);
+		r2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_mul_pd(dz, dz));
+		mask = _mm_and_pd(_mm_cmpgt_pd(r2, zero), _mm_cmplt_pd(r2, limit));
+		r2 = _mm_max_pd(r2, tiny);
+		y = _mm_cvtps_pd(_mm_rsqrt_ps(_mm_cvtpd_ps(r2)));
+		y = _mm_mul_pd(y, _mm_sub_pd(threeHalves, _mm_mul_pd(_mm_mul_pd(half, r2), _mm_mul_pd(y, y))));
+		y = _mm_mul_pd(y, _mm_sub_pd(threeHalves, _mm_mul_pd(_mm_mul_pd(half, r2), _mm_mul_pd(y, y))));
+		force = _mm_mul_pd(_mm_mul_pd(vgm, _mm_loadu_pd(&s->mass[j])), _mm_mul_pd(y, _mm_mul_pd(y, y)));
+		force = _mm_and_pd(force, mask);
+		dx = _mm_mul_pd(force, dx);
+		dy = _mm_mul_pd(force, dy);
+		dz = _mm_mul_pd(force, dz);
+		ax = _mm_add_pd(ax, dx);
+		ay = _mm_add_pd(ay, dy);
+		az = _mm_add_pd(az, dz);
+		if (s->fx) {
+			_mm_storeu_pd(&s->fx[j], _mm_sub_pd(_mm_loadu_pd(&s->fx[j]), dx));
+			_mm_storeu_pd(&s->fy[j], _mm_sub_pd(_mm_loadu_pd(&s->fy[j]), dy));
+			_mm_storeu_pd(&s->fz[j], _mm_sub_pd(_mm_loadu_pd(&s->fz[j]), dz));
+		}
+	}
+	_mm_storeu_pd(sum, ax); acc->x += sum[0] + sum[1];
+	_mm_storeu_pd(sum, ay); acc->y += sum[0] + sum[1];
+	_mm_storeu_pd(sum, az); acc->z += sum[0] + sum[1];
+	pairForceScalar(pos, gm, s, j, last, acc);
+}
+
+
+__attribute__((target("avx2,fma")))
+void pairForceAvx2(vector pos, double gm, pairSource *s, int first, int last, vector *acc) {
+	int j = first;
+	double sum[4];
+	__m256d px = _mm256_set1_pd(pos.x),
+		py = _mm256_set1_pd(pos.y),
+		pz = _mm256_set1_pd(pos.z),
+		vgm = _mm256_set1_pd(gm),
+		limit = _mm256_set1_pd(cutoffSquared),
+		tiny = _mm256_set1_pd(1.0e-30),
+		zero = _mm256_setzero_pd(),
+		half = _mm256_set1_pd(0.5),
+		threeHalves = _mm256_set1_pd(1.5),
+		ax = zero, ay = zero, az = zero,
+		dx, dy, dz, r2, y, force, mask;
+	for (; j+4<=last; j+=4) {
+		dx = _mm256_sub_pd(_mm256_loadu_pd(&s->x[j]), px);
+		dy = _mm256_sub_pd(_mm256_loadu_pd(&s->y[j]), py);
+		dz = _mm256_sub_pd(_mm256_loadu_pd(&s->z[j]), pz);
+		r2 = _mm256_fmadd_pd(dz, dz, _mm256_fmadd_pd(dy, dy, _mm256_mul_pd(dx, dx)));
+		mask = _mm256_and_pd(_mm256_cmp_pd(r2, zero, _CMP_GT_OQ), _mm256_cmp_pd(r2, limit, _CMP_LT_OQ));
+		r2 = _mm256_max_pd(r2, tiny);
+		y = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(r2)));
+		y = _mm256_mul_pd(y, _mm256_fnmadd_pd(_mm256_mul_pd(half, r2), _mm256_mul_pd(y, y), threeHalves));
+		y = _mm256_mul_pd(y, _mm256_fnmadd_pd(_mm256_mul_pd(half, r2), _mm256_mul_pd(y, y), threeHalves));
+		force = _mm256_mul_pd(_mm256_mul_pd(vgm, _mm256_loadu_pd(&s->mass[j])), _mm256_mul_pd(y, _mm256_mul_pd(y, y)));
+		force = _mm256_and_pd(force, mask);
+		ax = _mm256_fmadd_pd(force, dx, ax);
+		ay = _mm256_fmadd_pd(force, dy, ay);
+		az = _mm256_fmadd_pd(force, dz, az);
+		if (s->fx) {
+			_mm256_storeu_pd(&s->fx[j], _mm256_fnmadd_pd(force, dx, _mm256_loadu_pd(&s->fx[j])));
+			_mm256_storeu_pd(&s->fy[j], _mm256_fnmadd_pd(force, dy, _mm256_loadu_pd(&s->fy[j])));
+			_mm256_storeu_pd(&s->fz[j], _mm256_fnmadd_pd(force, dz, _mm256_loadu_pd(&s->fz[j])));
+		}
+	}
+	_mm256_storeu_pd(sum, ax); acc->x += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+	_mm256_storeu_pd(sum, ay); acc->y += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+	_mm256_storeu_pd(sum, az); acc->z += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+	pairForceScalar(pos, gm, s, j, last, acc);
+}
+
+
+__attribute__((target("avx512f")))
+void pairForceAvx512(vector pos, double gm, pairSource *s, int first, int last, vector *acc) {
+	int j = first;
+	__mmask8 mask;
+	__m512d px = _mm512_set1_pd(pos.x),
+		py = _mm512_set1_pd(pos.y),
+		pz = _mm512_set1_pd(pos.z),
+		vgm = _mm512_set1_pd(gm),
+		limit = _mm512_set1_pd(cutoffSquared),
+		tiny = _mm512_set1_pd(1.0e-30),
+		zero = _mm512_setzero_pd(),
+		half = _mm512_set1_pd(0.5),
+		threeHalves = _mm512_set1_pd(1.5),
+		ax = zero, ay = zero, az = zero,
+		dx, dy, dz, r2, y, force;
+	for (; j+8<=last; j+=8) {
+		dx = _mm512_sub_pd(_mm512_loadu_pd(&s->x[j]), px);
+		dy = _mm512_sub_pd(_mm512_loadu_pd(&s->y[j]), py);
+		dz = _mm512_sub_pd(_mm512_loadu_pd(&s->z[j]), pz);
+		r2 = _mm512_fmadd_pd(dz, dz, _mm512_fmadd_pd(dy, dy, _mm512_mul_pd(dx, dx)));
+		mask = _mm512_cmp_pd_mask(r2, zero, _CMP_GT_OQ) & _mm512_cmp_pd_mask(r2, limit, _CMP_LT_OQ);
+		r2 = _mm512_max_pd(r2, tiny);
+		y = _mm512_rsqrt14_pd(r2);
+		y = _mm512_mul_pd(y, _mm512_fnmadd_pd(_mm512_mul_pd(half, r2), _mm512_mul_pd(y, y), threeHalves));
+		y = _mm512_mul_pd(y, _mm512_fnmadd_pd(_mm512_mul_pd(half, r2), _mm512_mul_pd(y, y), threeHalves));
+		force = _mm512_maskz_mul_pd(mask, _mm512_mul_pd(vgm, _mm512_loadu_pd(&s->mass[j])), _mm512_mul_pd(y, _mm512_mul_pd(y, y)));
+		ax = _mm512_fmadd_pd(force, dx, ax);
+		ay = _mm512_fmadd_pd(force, dy, ay);
+		az = _mm512_fmadd_pd(force, dz, az);
+		if (s->fx) {
+			_mm512_storeu_pd(&s->fx[j], _mm512_fnmadd_pd(force, dx, _mm512_loadu_pd(&s->fx[j])));
+			_mm512_storeu_pd(&s->fy[j], _mm512_fnmadd_pd(force, dy, _mm512_loadu_pd(&s->fy[j])));
+			_mm512_storeu_pd(&s->fz[j], _mm512_fnmadd_pd(force, dz, _mm512_loadu_pd(&s->fz[j])));
+		}
+	}
+	acc->x += _mm512_reduce_add_pd(ax);
+	acc->y += _mm512_reduce_add_pd(ay);
+	acc->z += _mm512_reduce_add_pd(az);
+	pairForceScalar(pos, gm, s, j, last, acc);
+}
+
+// float32 kernels: one Newton step brings the estimate to full float precision,
+// the products are widened to double before they are summed
+
+__attribute__((target("sse2")))
+void pairForceSse2Float(vector pos, double gm, pairSource *s, int first, int last, vector *acc) {
+	int j = first;
+	double sum[2];
+	__m128 px = _mm_set1_ps(pos.x),
+		py = _mm_set1_ps(pos.y),
+		pz = _mm_set1_ps(pos.z),
+		vgm = _mm_set1_ps(gm),
+		limit = _mm_set1_ps(cutoffSquared),
+		tiny = _mm_set1_ps(1.0e-30),
+		zero = _mm_setzero_ps(),
+		half = _mm_set1_ps(0.5),
+		threeHalves = _mm_set1_ps(1.5),
+		dx, dy, dz, r2, y, force, mask;
+	__m128d ax = _mm_setzero_pd(),
+		ay = _mm_setzero_pd(),
+		az = _mm_setzero_pd(),
+		lo, hi;
+	for (; j+4<=last; j+=4) {
+		dx = _mm_sub_ps(_mm_loadu_ps(&s->xf[j]), px);
+		dy = _mm_sub_ps(_mm_loadu_ps(&s->yf[j]), py);
+		dz = _mm_sub_ps(_mm_loadu_ps(&s->zf[j]), pz);
+		r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+		mask = _mm_and_ps(_mm_cmpgt_ps(r2, zero), _mm_cmplt_ps(r2, limit));
+		r2 = _mm_max_ps(r2, tiny);
+		y = _mm_rsqrt_ps(r2);
+		y = _mm_mul_ps(y, _mm_sub_ps(threeHalves, _mm_mul_ps(_mm_mul_ps(half, r2), _mm_mul_ps(y, y))));
+		force = _mm_mul_ps(_mm_mul_ps(vgm, _mm_loadu_ps(&s->massf[j])), _mm_mul_ps(y, _mm_mul_ps(y, y)));
+		force = _mm_and_ps(force, mask);
+		dx = _mm_mul_ps(force, dx);
+		dy = _mm_mul_ps(force, dy);
+		dz = _mm_mul_ps(force, dz);
+		lo = _mm_cvtps_pd(dx); hi = _mm_cvtps_pd(_mm_movehl_ps(dx, dx));
+		ax = _mm_add_pd(ax, _mm_add_pd(lo, hi));
+		if (s->fx) {
+			_mm_storeu_pd(&s->fx[j], _mm_sub_pd(_mm_loadu_pd(&s->fx[j]), lo));
+			_mm_storeu_pd(&s->fx[j+2], _mm_sub_pd(_mm_loadu_pd(&s->fx[j+2]), hi));
+		}
+		lo = _mm_cvtps_pd(dy); hi = _mm_cvtps_pd(_mm_movehl_ps(dy, dy));
+		ay = _mm_add_pd(ay, _mm_add_pd(lo, hi));
+		if (s->fx) {
+			_mm_storeu_pd(&s->fy[j], _mm_sub_pd(_mm_loadu_pd(&s->fy[j]), lo));
+			_mm_storeu_pd(&s->fy[j+2], _mm_sub_pd(_mm_loadu_pd(&s->fy[j+2]), hi));
+		}
+		lo = _mm_cvtps_pd(dz); hi = _mm_cvtps_pd(_mm_movehl_ps(dz, dz));
+		az = _mm_add_pd(az, _mm_add_pd(lo, hi));
+		if (s->fx) {
+			_mm_storeu_pd(&s->fz[j], _mm_sub_pd(_mm_loadu_pd(&s->fz[j]), lo));
+			_mm_storeu_pd(&s->fz[j+2], _mm_sub_pd(_mm_loadu_pd(&s->fz[j+2]), hi));
+		}
+	}
+	_mm_storeu_pd(sum, ax); acc->x += sum[0] + sum[1];
+	_mm_storeu_pd(sum, ay); acc->y += sum[0] + sum[1];
+	_mm_storeu_pd(sum, az); acc->z += sum[0] + sum[1];
+	pairForceScalarFloat(pos, gm, s, j, last, acc);
+}
+
+
+__attribute__((target("avx2,fma")))
+void pairForceAvx2Float(vector pos, double gm, pairSource *s, int first, int last, vector *acc) {
+	int j = first;
+	double sum[4];
+	__m256 px = _mm256_set1_ps(pos.x),
+		py = _mm256_set1_ps(pos.y),
+		pz = _mm256_set1_ps(pos.z),
+		vgm = _mm256_set1_ps(gm),
+		limit = _mm256_set1_ps(cutoffSquared),
+		tiny = _mm256_set1_ps(1.0e-30),
+		zero = _mm256_setzero_ps(),
+		half = _mm256_set1_ps(0.5),
+		threeHalves = _mm256_set1_ps(1.5),
+		dx, dy, dz, r2, y, force, mask;
+	__m256d ax = _mm256_setzero_pd(),
+		ay = _mm256_setzero_pd(),
+		az = _mm256_setzero_pd(),
+		lo, hi;
+	for (; j+8<=last; j+=8) {
+		dx = _mm256_sub_ps(_mm256_loadu_ps(&s->xf[j]), px);
+		dy = _mm256_sub_ps(_mm256_loadu_ps(&s->yf[j]), py);
+		dz = _mm256_sub_ps(_mm256_loadu_ps(&s->zf[j]), pz);
+		r2 = _mm256_fmadd_ps(dz, dz, _mm256_fmadd_ps(dy, dy, _mm256_mul_ps(dx, dx)));
+		mask = _mm256_and_ps(_mm256_cmp_ps(r2, zero, _CMP_GT_OQ), _mm256_cmp_ps(r2, limit, _CMP_LT_OQ));
+		r2 = _mm256_max_ps(r2, tiny);
+		y = _mm256_rsqrt_ps(r2);
+		y = _mm256_mul_ps(y, _mm256_fnmadd_ps(_mm256_mul_ps(half, r2), _mm256_mul_ps(y, y), threeHalves));
+		force = _mm256_mul_ps(_mm256_mul_ps(vgm, _mm256_loadu_ps(&s->massf[j])), _mm256_mul_ps(y, _mm256_mul_ps(y, y)));
+		force = _mm256_and_ps(force, mask);
+		dx = _mm256_mul_ps(force, dx);
+		dy = _mm256_mul_ps(force, dy);
+		dz = _mm256_mul_ps(force, dz);
+		lo = _mm256_cvtps_pd(_mm256_castps256_ps128(dx)); hi = _mm256_cvtps_pd(_mm256_extractf128_ps(dx, 1));
+		ax = _mm256_add_pd(ax, _mm256_add_pd(lo, hi));
+		if (s->fx) {
+			_mm256_storeu_pd(&s->fx[j], _mm256_sub_pd(_mm256_loadu_pd(&s->fx[j]), lo));
+			_mm256_storeu_pd(&s->fx[j+4], _mm256_sub_pd(_mm256_loadu_pd(&s->fx[j+4]), hi));
+		}
+		lo = _mm256_cvtps_pd(_mm256_castps256_ps128(dy)); hi = _mm256_cvtps_pd(_mm256_extractf128_ps(dy, 1));
+		ay = _mm256_add_pd(ay, _mm256_add_pd(lo, hi));
+		if (s->fx) {
+			_mm256_storeu_pd(&s->fy[j], _mm256_sub_pd(_mm256_loadu_pd(&s->fy[j]), lo));
+			_mm256_storeu_pd(&s->fy[j+4], _mm256_sub_pd(_mm256_loadu_pd(&s->fy[j+4]), hi));
+		}
+		lo = _mm256_cvtps_pd(_mm256_castps256_ps128(dz)); hi = _mm256_cvtps_pd(_mm256_extractf128_ps(dz, 1));
+		az = _mm256_add_pd(az, _mm256_add_pd(lo, hi));
+		if (s->fx) {
+			_mm256_storeu_pd(&s->fz[j], _mm256_sub_pd(_mm256_loadu_pd(&s->fz[j]), lo));
+			_mm256_storeu_pd(&s->fz[j+4], _mm256_sub_pd(_mm256_loadu_pd(&s->fz[j+4]), hi));
+		}
+	}
+	_mm256_storeu_pd(sum, ax); acc->x += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+	_mm256_storeu_pd(sum, ay); acc->y += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+	_mm256_storeu_pd(sum, az); acc->z += (sum[0] + sum[1]) + (sum[2] + sum[3]);
+	pairForceScalarFloat(pos, gm, s, j, last, acc);
+}
+
+
+__attribute__((target("avx512f")))
+void pairForceAvx512Float(vector pos, double gm, pairSource *s, int first, int last, vector *acc) {
+	int j = first;
+	__mmask16 mask;
+	__m512 px = _mm512_set1_ps(pos.x),
+		py = _mm512_set1_ps(pos.y),
+		pz = _mm512_set1_ps(pos.z),
+		vgm = _mm512_set1_ps(gm),
+		limit = _mm512_set1_ps(cutoffSquared),
+		tiny = _mm512_set1_ps(1.0e-30),
+		zero = _mm512_setzero_ps(),
+		half = _mm512_set1_ps(0.5),
+		threeHalves = _mm512_set1_ps(1.5),
+		dx, dy, dz, r2, y, force;
+	__m512d ax = _mm512_setzero_pd(),
+		ay = _mm512_setzero_pd(),
+		az = _mm512_setzero_pd(),
+		lo, hi;
+	for (; j+16<=last; j+=16) {
+		dx = _mm512_sub_ps(_mm512_loadu_ps(&s->xf[j]), px);
+		dy = _mm512_sub_ps(_mm512_loadu_ps(&s->yf[j]), py);
+		dz = _mm512_sub_ps(_mm512_loadu_ps(&s->zf[j]), pz);
+		r2 = _mm512_fmadd_ps(dz, dz, _mm512_fmadd_ps(dy, dy, _mm512_mul_ps(dx, dx)));
+		mask = _mm512_cmp_ps_mask(r2, zero, _CMP_GT_OQ) & _mm512_cmp_ps_mask(r2, limit, _CMP_LT_OQ);
+		r2 = _mm512_max_ps(r2, tiny);
+		y = _mm512_rsqrt14_ps(r2);
+		y = _mm512_mul_ps(y, _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(y, y), threeHalves));
+		force = _mm512_maskz_mul_ps(mask, _mm512_mul_ps(vgm, _mm512_loadu_ps(&s->massf[j])), _mm512_mul_ps(y, _mm512_mul_ps(y, y)));
+		dx = _mm512_mul_ps(force, dx);
+		dy = _mm512_mul_ps(force, dy);
+		dz = _mm512_mul_ps(force, dz);
+		lo = _mm512_cvtps_pd(_mm512_castps512_ps256(dx)); hi = _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(dx), 1)));
+		ax = _mm512_add_pd(ax, _mm512_add_pd(lo, hi));
+		if (s->fx) {
+			_mm512_storeu_pd(&s->fx[j], _mm512_sub_pd(_mm512_loadu_pd(&s->fx[j]), lo));
+			_mm512_storeu_pd(&s->fx[j+8], _mm512_sub_pd(_mm512_loadu_pd(&s->fx[j+8]), hi));
+		}
+		lo = _mm512_cvtps_pd(_mm512_castps512_ps256(dy)); hi = _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(dy), 1)));
+		ay = _mm512_add_pd(ay, _mm512_add_pd(lo, hi));
+		if (s->fx) {
+			_mm512_storeu_pd(&s->fy[j], _mm512_sub_pd(_mm512_loadu_pd(&s->fy[j]), lo));
+			_mm512_storeu_pd(&s->fy[j+8], _mm512_sub_pd(_mm512_loadu_pd(&s->fy[j+8]), hi));
+		}
+		lo = _mm512_cvtps_pd(_mm512_castps512_ps256(dz)); hi = _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(dz), 1)));
+		az = _mm512_add_pd(az, _mm512_add_pd(lo, hi));
+		if (s->fx) {
+			_mm512_storeu_pd(&s->fz[j], _mm512_sub_pd(_mm512_loadu_pd(&s->fz[j]), lo));
+			_mm512_storeu_pd(&s->fz[j+8], _mm512_sub_pd(_mm512_loadu_pd(&s->fz[j+8]), hi));
+		}
+	}
+	acc->x += _mm512_reduce_add_pd(ax);
+	acc->y += _mm512_reduce_add_pd(ay);
+	acc->z += _mm512_reduce_add_pd(az);
+	pairForceScalarFloat(pos, gm, s, j, last, acc);
+}
+#endif
+
+
+void initKernel(void) {
+	// picks the widest kernel the cpu supports unless -k asked for another one
+	int best = KERNEL_SCALAR;
+#ifdef SIMD_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		best = KERNEL_SSE2;
+	}
+	if (__builtin_cpu_supports("avx2") & __builtin_cpu_supports("fma")) {
+		best = KERNEL_AVX2;
+	}
+	if (__builtin_cpu_supports("avx512f")) {
+		best = KERNEL_AVX512;
+	}
+#endif
+	if (kernel < 0) {
+		kernel = best;
+	}
+	if (kernel > best) {
+		printf("ERROR: the %s kernel is not supported by this cpu\n", kernelName[kernel]);
+		exit(EXIT_FAILURE);
+	}
+	switch (kernel) {
+#ifdef SIMD_KERNELS
+		case KERNEL_SSE2:
+			pairForce = singlePrecision ? pairForceSse2Float : pairForceSse2;
+			break;
+		case KERNEL_AVX2:
+			pairForce = singlePrecision ? pairForceAvx2Float : pairForceAvx2;
+			break;
+		case KERNEL_AVX512:
+			pairForce = singlePrecision ? pairForceAvx512Float : pairForceAvx512;
+			break;
+#endif
+		default:
+			pairForce = singlePrecision ? pairForceScalarFloat : pairForceScalar;
+			break;
+	}
+	cutoffSquared = cutoff ? minPerception * minPerception : HUGE_VAL;
+}
+
+
+void pairBlocks(int round, int k, int *b1, int *b2) {
+	// round 0 pairs each block with itself, the others follow the circle
+	// method so that the blocks of a round are all distinct
+	int n = nbBlocks + (nbBlocks % 2);
+	if (round == 0) {
+		*b1 = k;
+		*b2 = k;
+		return;
+	}
+	round--;
+	if (k == 0) {
+		*b1 = round;
+		*b2 = n - 1;
 	} else {
-		rotz += 0.0;
+		*b1 = (round + k) % (n - 1);
+		*b2 = (round - k + n - 1) % (n - 1);
 	}
-	if (rotz > 360) rotz = 360;
-	glutPostRedisplay();
-	glutTimerFunc(dt, onTimer, 0);
 }
 
 
-vector meanColor(int o1) {
-	int o2 = 0,
-		numNeighbors = 0;
-	double dist = 0;
-	vector sum;
-	sum.x=0.0; sum.y=0.0; sum.z=0.0;
-	for (o2=0; o2<sampleSize; o2++) {
-		dist = distance(objectsList[o1], objectsList[o2]);
-		if ((dist>0) & (dist < minDistance)) {
-			sum = addVec(sum, objectsList[o2].color);
-			numNeighbors++;
+void pairForceTask(int task) {
+	// Newton's third law: each pair is visited once and both bodies updated,
+	// the schedule makes the block forces free of races and deterministic.
+	// Every body of the i-block sweeps a j-tile before the next one is loaded
+	int b1=0, b2=0, i=0, t=0, first=0, lastI=0, lastJ=0, tileEnd=0;
+	vector acc;
+	particles *p = objectsList;
+	pairSource s = {p->x, p->y, p->z, p->mass, p->fx, p->fy, p->fz, p->xf, p->yf, p->zf, p->massf};
+	pairBlocks(pairRound, task, &b1, &b2);
+	if ((b1 >= nbBlocks) | (b2 >= nbBlocks)) { return; }
+	lastI = (b1 + 1) * pairBlockSize < sampleSize ? (b1 + 1) * pairBlockSize : sampleSize;
+	lastJ = (b2 + 1) * pairBlockSize < sampleSize ? (b2 + 1) * pairBlockSize : sampleSize;
+	for (t=b2*pairBlockSize; t<lastJ; t+=tileSize) {
+		tileEnd = t + tileSize < lastJ ? t + tileSize : lastJ;
+		for (i=b1*pairBlockSize; i<lastI; i++) {
+			first = ((b1 == b2) && (i + 1 > t)) ? i + 1 : t;
+			if (first >= tileEnd) {
+				break;
+			}
+			acc.x=0.0; acc.y=0.0; acc.z=0.0;
+			pairForce(getPos(p, i), g * p->mass[i], &s, first, tileEnd, &acc);
+			p->fx[i] += acc.x;
+			p->fy[i] += acc.y;
+			p->fz[i] += acc.z;
 		}
 	}
-	if (numNeighbors) {
-		sum = divVecByScalar(sum, numNeighbors);
-		sum = normalize(sum);
+}
+
+
+void pairForces(void) {
+	int n = 0;
+	nbBlocks = (sampleSize + pairBlockSize - 1) / pairBlockSize;
+	n = nbBlocks + (nbBlocks % 2);
+	for (pairRound=0; pairRound<n; pairRound++) {
+		runTasks(pairRound ? n / 2 : nbBlocks, pairForceTask);
+	}
+}
+
+
+void initTiles(void) {
+	// a tile of sources and the bodies of the i-block share half of L1,
+	// the two blocks of a task with their forces fill half of L2
+	long l1 = sysconf(_SC_LEVEL1_DCACHE_SIZE),
+		l2 = sysconf(_SC_LEVEL2_CACHE_SIZE),
+		body = 4 * (singlePrecision ? sizeof(float) : sizeof(double)) + 3 * sizeof(double);
+	int spread = 0;
+	if (l1 <= 0) {
+		l1 = 32768;
+	}
+	if (l2 <= 0) {
+		l2 = 262144;
+	}
+	tileSize = (int)(l1 / 2 / body);
+	tileSize = tileSize < 16 ? 16 : tileSize - tileSize % 16;
+	pairBlockSize = (int)(l2 / 2 / (2 * body));
+	pairBlockSize = pairBlockSize < tileSize ? tileSize : pairBlockSize - pairBlockSize % tileSize;
+	// depends on the cache sizes and the bodies only, so that the order of the
+	// sums and the forces are the same for any number of threads
+	spread = (sampleSize + PAIRBLOCKS - 1) / PAIRBLOCKS;
+	spread = ((spread + tileSize - 1) / tileSize) * tileSize;
+	if (pairBlockSize > spread) {
+		pairBlockSize = spread;
+	}
+}
+
+
+vector gravitationalForceGrid(int o1) {
+	int r = 0,
+		nbRanges = 0,
+		first[9], last[9];
+	vector acc, pos;
+	pairSource s = {gravityGrid.x, gravityGrid.y, gravityGrid.z, gravityGrid.mass, NULL, NULL, NULL,
+		gravityGrid.xf, gravityGrid.yf, gravityGrid.zf, gravityGrid.massf};
+	acc.x=0.0; acc.y=0.0; acc.z=0.0;
+	pos = getPos(objectsList, o1);
+	nbRanges = gridNeighbors(&gravityGrid, pos, first, last);
+	for (r=0; r<nbRanges; r++) {
+		pairForce(pos, g * objectsList->mass[o1], &s, first[r], last[r], &acc);
+	}
+	return(acc);
+}
+
+
+int newOctreeNode(void) {
+	if (octreeSize == octreeCapacity) {
+		octreeCapacity = octreeCapacity ? 2 * octreeCapacity : 1024;
+		octree = realloc(octree, octreeCapacity * sizeof(octreeNode));
+	}
+	return(octreeSize++);
+}
+
+
+int octant(vector p, vector c) {
+	return((p.x >= c.x) | ((p.y >= c.y) << 1) | ((p.z >= c.z) << 2));
+}
+
+
+void buildOctreeNode(int node, int first, int count, vector center, double halfSize, int depth) {
+	int i=0, o=0, child=0, nbChild=0,
+		nb[8], start[8];
+	double h = halfSize / 2.0;
+	vector com, c;
+	com.x=0.0; com.y=0.0; com.z=0.0;
+
+	octree[node].center = center;
+	octree[node].halfSize = halfSize;
+	octree[node].first = first;
+	octree[node].count = count;
+	octree[node].mass = 0.0;
+	octree[node].child = -1;
+	octree[node].nbChild = 0;
+
+	if ((count <= leafSize) | (depth >= MAXDEPTH)) {
+		for (i=first; i<first+count; i++) {
+			octree[node].mass += objectsList->mass[octreeIndex[i]];
+			com = addVec(com, mulVecByScalar(getPos(objectsList, octreeIndex[i]), objectsList->mass[octreeIndex[i]]));
+		}
+		octree[node].com = divVecByScalar(com, octree[node].mass);
+		return;
+	}
+
+	// counting sort of the bodies into the eight octants
+	for (o=0; o<8; o++) { nb[o] = 0; }
+	for (i=first; i<first+count; i++) {
+		nb[octant(getPos(objectsList, octreeIndex[i]), center)]++;
+	}
+	start[0] = first;
+	for (o=1; o<8; o++) { start[o] = start[o-1] + nb[o-1]; }
+	for (i=first; i<first+count; i++) {
+		o = octant(getPos(objectsList, octreeIndex[i]), center);
+		octreeTemp[start[o]++] = octreeIndex[i];
+	}
+	memcpy(&octreeIndex[first], &octreeTemp[first], count * sizeof(int));
+
+	for (o=0; o<8; o++) {
+		if (nb[o]) { nbChild++; }
+	}
+	child = newOctreeNode();
+	for (o=1; o<nbChild; o++) { newOctreeNode(); }
+	octree[node].child = child;
+	octree[node].nbChild = nbChild;
+
+	start[0] = first;
+	for (o=0; o<8; o++) {
+		if (o) { start[o] = start[o-1] + nb[o-1]; }
+		if (nb[o]) {
+			c.x = center.x + ((o & 1) ? h : -h);
+			c.y = center.y + ((o & 2) ? h : -h);
+			c.z = center.z + ((o & 4) ? h : -h);
+			buildOctreeNode(child, start[o], nb[o], c, h, depth+1);
+			com = addVec(com, mulVecByScalar(octree[child].com, octree[child].mass));
+			octree[node].mass += octree[child].mass;
+			child++;
+		}
+	}
+	octree[node].com = divVecByScalar(com, octree[node].mass);
+}
+
+
+void buildOctree(void) {
+	int i=0;
+	double halfSize=0.0;
+	vector low, high, center;
+	low = getPos(objectsList, 0);
+	high = getPos(objectsList, 0);
+	for (i=0; i<sampleSize; i++) {
+		low.x = fmin(low.x, objectsList->x[i]);
+		low.y = fmin(low.y, objectsList->y[i]);
+		low.z = fmin(low.z, objectsList->z[i]);
+		high.x = fmax(high.x, objectsList->x[i]);
+		high.y = fmax(high.y, objectsList->y[i]);
+		high.z = fmax(high.z, objectsList->z[i]);
+		octreeIndex[i] = i;
+	}
+	center = mulVecByScalar(addVec(low, high), 0.5);
+	halfSize = fmax(fmax(high.x - low.x, high.y - low.y), high.z - low.z) * 0.5 + 1.0e-6;
+	octreeSize = 0;
+	buildOctreeNode(newOctreeNode(), 0, sampleSize, center, halfSize, 0);
+	// bodies copied in tree order, leaves are then contiguous in memory
+	for (i=0; i<sampleSize; i++) {
+		octreeX[i] = objectsList->x[octreeIndex[i]];
+		octreeY[i] = objectsList->y[octreeIndex[i]];
+		octreeZ[i] = objectsList->z[octreeIndex[i]];
+		octreeMass[i] = objectsList->mass[octreeIndex[i]];
+		octreeXf[i] = octreeX[i];
+		octreeYf[i] = octreeY[i];
+		octreeZf[i] = octreeZ[i];
+		octreeMassf[i] = octreeMass[i];
+	}
+}
+
+
+void collectGroups(int node) {
+	// subtrees of at most GROUPSIZE bodies, or deeper leaves, walk the tree together
+	int i = 0;
+	if ((octree[node].count <= GROUPSIZE) | (octree[node].nbChild == 0)) {
+		octreeGroups[nbGroups++] = node;
+		return;
+	}
+	for (i=0; i<octree[node].nbChild; i++) {
+		collectGroups(octree[node].child + i);
+	}
+}
+
+
+void flushList(interactionList *list, int group) {
+	// every body of the group sums the list with the pair kernel
+	int i = 0,
+		o = 0,
+		last = octree[group].first + octree[group].count;
+	vector acc;
+	pairSource s = {list->x, list->y, list->z, list->mass, NULL, NULL, NULL, list->xf, list->yf, list->zf, list->massf};
+	for (i=octree[group].first; i<last; i++) {
+		o = octreeIndex[i];
+		acc.x=0.0; acc.y=0.0; acc.z=0.0;
+		pairForce(getPos(objectsList, o), g * objectsList->mass[o], &s, 0, list->count, &acc);
+		objectsList->fx[o] += acc.x;
+		objectsList->fy[o] += acc.y;
+		objectsList->fz[o] += acc.z;
+	}
+	list->count = 0;
+}
+
+
+void addSource(interactionList *list, int group, vector pos, double mass) {
+	if (list->count == LISTSIZE) {
+		flushList(list, group);
+	}
+	if (singlePrecision) {
+		list->xf[list->count] = pos.x;
+		list->yf[list->count] = pos.y;
+		list->zf[list->count] = pos.z;
+		list->massf[list->count] = mass;
 	} else {
-		sum.x = objectsList[o1].color.x;
-		sum.y = objectsList[o1].color.y;
-		sum.z = objectsList[o1].color.z;
+		list->x[list->count] = pos.x;
+		list->y[list->count] = pos.y;
+		list->z[list->count] = pos.z;
+		list->mass[list->count] = mass;
 	}
-	return(sum);
+	list->count++;
 }
 
 
-void keepWithinBounds1(int i) {
-	double highLimit = 150.0,
-		lowLimit = -150.0;
-	if ((objectsList[i].pos.x >= highLimit) | (objectsList[i].pos.x < lowLimit)) {
-		objectsList[i].velocity.x = -1 * objectsList[i].velocity.x;
+void treeForceTask(int task) {
+	// the bodies of a group walk the tree once: a node far enough from the
+	// box of the whole group is a point mass, the leaves near it give their
+	// bodies, and the pair kernel sums that list for each body of the group
+	int i = 0,
+		node = 0,
+		top = 0,
+		group = octreeGroups[task],
+		first = octree[group].first,
+		last = octree[group].first + octree[group].count,
+		stack[8 * (MAXDEPTH + 1)];
+	double h=0.0, d=0.0, gap=0.0, dmin=0.0, dmax=0.0, dcom=0.0,
+		limit = minPerception * minPerception;
+	vector low, high, c, e, pos;
+	interactionList list;
+	low.x = octreeX[first]; low.y = octreeY[first]; low.z = octreeZ[first];
+	high = low;
+	for (i=first; i<last; i++) {
+		low.x = fmin(low.x, octreeX[i]); high.x = fmax(high.x, octreeX[i]);
+		low.y = fmin(low.y, octreeY[i]); high.y = fmax(high.y, octreeY[i]);
+		low.z = fmin(low.z, octreeZ[i]); high.z = fmax(high.z, octreeZ[i]);
+		objectsList->fx[octreeIndex[i]] = 0.0;
+		objectsList->fy[octreeIndex[i]] = 0.0;
+		objectsList->fz[octreeIndex[i]] = 0.0;
 	}
-	if ((objectsList[i].pos.y >= highLimit) | (objectsList[i].pos.y < lowLimit)) {
-		objectsList[i].velocity.y = -1 * objectsList[i].velocity.y;
+	c = mulVecByScalar(addVec(low, high), 0.5);
+	e = mulVecByScalar(subVec(high, low), 0.5);
+	list.count = 0;
+	stack[top++] = 0;
+	while (top) {
+		node = stack[--top];
+		h = octree[node].halfSize;
+		// node box to group box, nearest and farthest, and centre of mass to group box
+		dmin = 0.0; dmax = 0.0; dcom = 0.0;
+		d = fabs(c.x - octree[node].center.x);
+		gap = fmax(d - e.x - h, 0.0); dmin += gap * gap; dmax += (d + e.x + h) * (d + e.x + h);
+		gap = fmax(fabs(c.x - octree[node].com.x) - e.x, 0.0); dcom += gap * gap;
+		d = fabs(c.y - octree[node].center.y);
+		gap = fmax(d - e.y - h, 0.0); dmin += gap * gap; dmax += (d + e.y + h) * (d + e.y + h);
+		gap = fmax(fabs(c.y - octree[node].com.y) - e.y, 0.0); dcom += gap * gap;
+		d = fabs(c.z - octree[node].center.z);
+		gap = fmax(d - e.z - h, 0.0); dmin += gap * gap; dmax += (d + e.z + h) * (d + e.z + h);
+		gap = fmax(fabs(c.z - octree[node].com.z) - e.z, 0.0); dcom += gap * gap;
+		// nodes beyond minPerception are skipped, nodes straddling it are opened
+		if (cutoff && (dmin >= limit)) {
+			continue;
+		}
+		if (octree[node].nbChild == 0) {
+			for (i=octree[node].first; i<octree[node].first+octree[node].count; i++) {
+				pos.x = octreeX[i]; pos.y = octreeY[i]; pos.z = octreeZ[i];
+				addSource(&list, group, pos, octreeMass[i]);
+			}
+			continue;
+		}
+		if ((dmin > 0.0) & (!cutoff | (dmax < limit)) & (4.0 * h * h < theta * theta * dcom)) {
+			addSource(&list, group, octree[node].com, octree[node].mass);
+		} else {
+			for (i=0; i<octree[node].nbChild; i++) {
+				stack[top++] = octree[node].child + i;
+			}
+		}
 	}
-	if ((objectsList[i].pos.z >= highLimit) | (objectsList[i].pos.z < lowLimit)) {
-		objectsList[i].velocity.z = -1 * objectsList[i].velocity.z;
+	flushList(&list, group);
+}
+
+
+double binomial(int n, int k) {
+	int i = 0;
+	double r = 1.0;
+	for (i=1; i<=k; i++) {
+		r = r * (n - k + i) / i;
 	}
+	return(r);
 }
 
 
-void keepWithinBounds2(int i) {
-	double highLimit = 150.0,
-		lowLimit = -150.0;
-	if (objectsList[i].pos.x > highLimit) { objectsList[i].pos.x = lowLimit; }
-	if (objectsList[i].pos.x < lowLimit) { objectsList[i].pos.x = highLimit; }
-	if (objectsList[i].pos.y > highLimit) { objectsList[i].pos.y = lowLimit; }
-	if (objectsList[i].pos.y < lowLimit) { objectsList[i].pos.y = highLimit; }
-	if (objectsList[i].pos.z > highLimit) { objectsList[i].pos.z = lowLimit; }
-	if (objectsList[i].pos.z < lowLimit) { objectsList[i].pos.z = highLimit; }
+int fmmIndex(int x, int y, int z) {
+	if ((x < 0) | (y < 0) | (z < 0) | (x + y + z > fmmOrder)) { return(-1); }
+	return(fmmSlot[(x * (fmmOrder + 1) + y) * (fmmOrder + 1) + z]);
 }
 
 
-vector gravitationalForce(int o1) {
-	int o2 = 0,
-		numNeighbors = 0;
-	double force=0.0, dist=0.0;
-	vector acc, diff;
-	acc.x=0.0; acc.y=0.0; acc.z=0.0;
-	for (o2=0; o2<sampleSize; o2++) {
-		dist = distance(objectsList[o1], objectsList[o2]);
-		if ((dist > 0) & (dist < minPerception)) {
-			diff = subVec(objectsList[o2].pos, objectsList[o1].pos);
-			force = (g * objectsList[o1].mass * objectsList[o2].mass) / (dist * dist);
-			acc.x += (force * diff.x / dist);
-			acc.y += (force * diff.y / dist);
-			acc.z += (force * diff.z / dist);
-			numNeighbors++;
+void fmmAddTerm(fmmTerm **list, int *nb, int target, int source, int shift, double coef) {
+	*list = realloc(*list, (*nb + 1) * sizeof(fmmTerm));
+	(*list)[*nb].target = target;
+	(*list)[*nb].source = source;
+	(*list)[*nb].shift = shift;
+	(*list)[*nb].coef = coef;
+	(*nb)++;
+}
+
+
+void initFmm(void) {
+	int x=0, y=0, z=0, n=0, k=0, c=0, p=fmmOrder;
+	int *e1, *e2;
+	fmmSlot = calloc((p + 1) * (p + 1) * (p + 1), sizeof(int));
+	fmmExp = calloc(3 * (p + 1) * (p + 2) * (p + 3) / 6, sizeof(int));
+	fmmSign = calloc((p + 1) * (p + 2) * (p + 3) / 6, sizeof(double));
+	// coefficients sorted by total degree, the derivative recurrence relies on it
+	for (n=0; n<=p; n++) {
+		for (x=n; x>=0; x--) {
+			for (y=n-x; y>=0; y--) {
+				z = n - x - y;
+				fmmSlot[(x * (p + 1) + y) * (p + 1) + z] = c;
+				fmmExp[3*c] = x; fmmExp[3*c+1] = y; fmmExp[3*c+2] = z;
+				fmmSign[c] = (n % 2) ? -1.0 : 1.0;
+				c++;
+			}
 		}
 	}
-	if (numNeighbors) {
-		acc = normalize(acc);
-		acc = limitForce(acc, accFactor);
+	fmmNbCoef = c;
+	fmmPrev = calloc(6 * fmmNbCoef, sizeof(int));
+	for (n=0; n<fmmNbCoef; n++) {
+		e1 = &fmmExp[3*n];
+		for (k=0; k<3; k++) {
+			x = e1[0] - (k == 0); y = e1[1] - (k == 1); z = e1[2] - (k == 2);
+			fmmPrev[6*n+k] = fmmIndex(x, y, z);
+			fmmPrev[6*n+3+k] = fmmIndex(x - (k == 0), y - (k == 1), z - (k == 2));
+			// gradient of the local expansion: d/dy_k y^n = n_k y^(n-e_k)
+			if (fmmPrev[6*n+k] >= 0) {
+				fmmAddTerm(&fmmGrad, &fmmNbGrad, k, n, fmmPrev[6*n+k], e1[k]);
+			}
+		}
+		for (k=0; k<fmmNbCoef; k++) {
+			e2 = &fmmExp[3*k];
+			// M2M and L2L: source multi-index below target
+			if ((e2[0] <= e1[0]) & (e2[1] <= e1[1]) & (e2[2] <= e1[2])) {
+				c = fmmIndex(e1[0]-e2[0], e1[1]-e2[1], e1[2]-e2[2]);
+				fmmAddTerm(&fmmM2M, &fmmNbM2M, n, k, c, binomial(e1[0], e2[0]) * binomial(e1[1], e2[1]) * binomial(e1[2], e2[2]));
+				fmmAddTerm(&fmmL2L, &fmmNbL2L, k, n, c, binomial(e1[0], e2[0]) * binomial(e1[1], e2[1]) * binomial(e1[2], e2[2]));
+			}
+			// M2L: L_n += C(k+n, n) a_{k+n} M_k, truncated to |k|+|n| <= p
+			c = fmmIndex(e1[0]+e2[0], e1[1]+e2[1], e1[2]+e2[2]);
+			if (c >= 0) {
+				fmmAddTerm(&fmmM2L, &fmmNbM2L, n, k, c, binomial(e1[0]+e2[0], e1[0]) * binomial(e1[1]+e2[1], e1[1]) * binomial(e1[2]+e2[2], e1[2]));
+			}
+		}
 	}
-	return(acc);
 }
 
 
-void addEltPath(int o1) {
+void fmmPowers(vector d, double *pw) {
 	int i = 0;
-	vector *temp = calloc(maxPathLength, sizeof(vector));
+	double px[fmmOrder+1], py[fmmOrder+1], pz[fmmOrder+1];
+	px[0] = 1.0; py[0] = 1.0; pz[0] = 1.0;
+	for (i=1; i<=fmmOrder; i++) {
+		px[i] = px[i-1] * d.x;
+		py[i] = py[i-1] * d.y;
+		pz[i] = pz[i-1] * d.z;
+	}
+	for (i=0; i<fmmNbCoef; i++) {
+		pw[i] = px[fmmExp[3*i]] * py[fmmExp[3*i+1]] * pz[fmmExp[3*i+2]];
+	}
+}
 
-	if (pathLength < maxPathLength) {
-		objectsList[o1].path[pathLength] = objectsList[o1].pos;
+
+void fmmDerivatives(vector r, double *a) {
+	// Taylor coefficients a_k = d^k(1/r) / k!, computed with the recurrence
+	// n r^2 a_k = -(2n-1) sum_i r_i a_{k-e_i} - (n-1) sum_i a_{k-2e_i}
+	int i=0, d=0, n=0;
+	int *prev;
+	double r2 = (r.x * r.x) + (r.y * r.y) + (r.z * r.z),
+		rv[3] = {r.x, r.y, r.z},
+		s1=0.0, s2=0.0;
+	a[0] = 1.0 / sqrt(r2);
+	for (i=1; i<fmmNbCoef; i++) {
+		prev = &fmmPrev[6*i];
+		n = fmmExp[3*i] + fmmExp[3*i+1] + fmmExp[3*i+2];
+		s1 = 0.0; s2 = 0.0;
+		for (d=0; d<3; d++) {
+			if (prev[d] >= 0) { s1 += rv[d] * a[prev[d]]; }
+			if (prev[3+d] >= 0) { s2 += a[prev[3+d]]; }
+		}
+		a[i] = (-(2 * n - 1) * s1 - (n - 1) * s2) / (n * r2);
+	}
+}
+
+
+void fmmUpward(void) {
+	int node=0, i=0, c=0;
+	double pw[fmmNbCoef];
+	double *m;
+	vector d;
+	for (node=octreeSize-1; node>=0; node--) {
+		m = &fmmM[node * fmmNbCoef];
+		memset(m, 0, fmmNbCoef * sizeof(double));
+		fmmRadius[node] = 0.0;
+		if (octree[node].nbChild == 0) {
+			// P2M
+			for (i=octree[node].first; i<octree[node].first+octree[node].count; i++) {
+				d.x = octree[node].com.x - octreeX[i];
+				d.y = octree[node].com.y - octreeY[i];
+				d.z = octree[node].com.z - octreeZ[i];
+				fmmPowers(d, pw);
+				for (c=0; c<fmmNbCoef; c++) {
+					m[c] += octreeMass[i] * pw[c];
+				}
+				fmmRadius[node] = fmax(fmmRadius[node], magnitude(d));
+			}
+		} else {
+			// M2M
+			for (i=octree[node].child; i<octree[node].child+octree[node].nbChild; i++) {
+				d = subVec(octree[node].com, octree[i].com);
+				fmmPowers(d, pw);
+				for (c=0; c<fmmNbM2M; c++) {
+					m[fmmM2M[c].target] += fmmM2M[c].coef * pw[fmmM2M[c].shift] * fmmM[i * fmmNbCoef + fmmM2M[c].source];
+				}
+				fmmRadius[node] = fmax(fmmRadius[node], magnitude(d) + fmmRadius[i]);
+			}
+		}
+	}
+}
+
+
+void fmmP2P(int a, int b) {
+	int i = 0;
+	vector acc, pos;
+	pairSource s = {octreeX, octreeY, octreeZ, octreeMass, fmmFx, fmmFy, fmmFz, octreeXf, octreeYf, octreeZf, octreeMassf};
+	for (i=octree[a].first; i<octree[a].first+octree[a].count; i++) {
+		acc.x=0.0; acc.y=0.0; acc.z=0.0;
+		pos.x = octreeX[i]; pos.y = octreeY[i]; pos.z = octreeZ[i];
+		pairForce(pos, g * octreeMass[i], &s, (a == b) ? i + 1 : octree[b].first, octree[b].first + octree[b].count, &acc);
+		fmmFx[i] += acc.x;
+		fmmFy[i] += acc.y;
+		fmmFz[i] += acc.z;
+	}
+}
+
+
+void fmmM2LPair(int a, int b) {
+	// both directions share the derivatives, a_k(-r) = (-1)^|k| a_k(r)
+	int c = 0;
+	double deriv[fmmNbCoef];
+	double *la = &fmmL[a * fmmNbCoef],
+		*lb = &fmmL[b * fmmNbCoef],
+		*ma = &fmmM[a * fmmNbCoef],
+		*mb = &fmmM[b * fmmNbCoef];
+	fmmDerivatives(subVec(octree[a].com, octree[b].com), deriv);
+	for (c=0; c<fmmNbM2L; c++) {
+		la[fmmM2L[c].target] += fmmM2L[c].coef * deriv[fmmM2L[c].shift] * mb[fmmM2L[c].source];
+		lb[fmmM2L[c].target] += fmmM2L[c].coef * fmmSign[fmmM2L[c].shift] * deriv[fmmM2L[c].shift] * ma[fmmM2L[c].source];
+	}
+}
+
+
+void fmmInteract(int a, int b) {
+	int i=0, j=0;
+	double dist = 0.0;
+	if (a == b) {
+		if (octree[a].nbChild == 0) {
+			fmmP2P(a, a);
+		} else {
+			for (i=octree[a].child; i<octree[a].child+octree[a].nbChild; i++) {
+				for (j=i; j<octree[a].child+octree[a].nbChild; j++) {
+					fmmInteract(i, j);
+				}
+			}
+		}
+		return;
+	}
+	dist = magnitude(subVec(octree[a].com, octree[b].com));
+	if (fmmRadius[a] + fmmRadius[b] < theta * dist) {
+		fmmM2LPair(a, b);
+	} else if ((octree[a].nbChild == 0) & (octree[b].nbChild == 0)) {
+		fmmP2P(a, b);
+	} else if ((octree[b].nbChild == 0) | ((octree[a].nbChild != 0) & (fmmRadius[a] >= fmmRadius[b]))) {
+		for (i=octree[a].child; i<octree[a].child+octree[a].nbChild; i++) {
+			fmmInteract(i, b);
+		}
 	} else {
-		for (i=1; i<maxPathLength; i++) {
-			temp[i-1] = objectsList[o1].path[i];
+		for (j=octree[b].child; j<octree[b].child+octree[b].nbChild; j++) {
+			fmmInteract(a, j);
 		}
-		temp[maxPathLength-1] = objectsList[o1].pos;
-		for (i=0; i<maxPathLength; i++) {
-			objectsList[o1].path[i] = temp[i];
+	}
+}
+
+
+void fmmDownward(void) {
+	int node=0, i=0, c=0;
+	double pw[fmmNbCoef],
+		grad[3];
+	double *l;
+	vector y;
+	for (node=0; node<octreeSize; node++) {
+		l = &fmmL[node * fmmNbCoef];
+		if (octree[node].nbChild) {
+			// L2L
+			for (i=octree[node].child; i<octree[node].child+octree[node].nbChild; i++) {
+				fmmPowers(subVec(octree[i].com, octree[node].com), pw);
+				for (c=0; c<fmmNbL2L; c++) {
+					fmmL[i * fmmNbCoef + fmmL2L[c].target] += fmmL2L[c].coef * pw[fmmL2L[c].shift] * l[fmmL2L[c].source];
+				}
+			}
+		} else {
+			// L2P, the force is g m grad(phi)
+			for (i=octree[node].first; i<octree[node].first+octree[node].count; i++) {
+				y.x = octreeX[i] - octree[node].com.x;
+				y.y = octreeY[i] - octree[node].com.y;
+				y.z = octreeZ[i] - octree[node].com.z;
+				fmmPowers(y, pw);
+				grad[0]=0.0; grad[1]=0.0; grad[2]=0.0;
+				for (c=0; c<fmmNbGrad; c++) {
+					grad[fmmGrad[c].target] += fmmGrad[c].coef * l[fmmGrad[c].source] * pw[fmmGrad[c].shift];
+				}
+				fmmFx[i] += g * octreeMass[i] * grad[0];
+				fmmFy[i] += g * octreeMass[i] * grad[1];
+				fmmFz[i] += g * octreeMass[i] * grad[2];
+			}
 		}
 	}
 }
 
 
-void update(int value) {
-	int i=0;
-	vector acc, col;
-	pathLength ++;
-
-	for (i=0; i<value; i++) {
-		col = meanColor(i);
-		objectsList[i].color.x = col.x;
-		objectsList[i].color.y = col.y;
-		objectsList[i].color.z = col.z;
-		acc = gravitationalForce(i);
-		objectsList[i].velocity = addVec(objectsList[i].velocity, acc);
-		objectsList[i].pos = addVec(objectsList[i].pos, objectsList[i].velocity);
+void fmmReport(double elapsed) {
+	// relative force error of a few bodies against direct summation,
+	// bodies without a net force have no relative error and are skipped
+	int i=0, o1=0, o2=0, used=0;
+	double force=0.0, dist=0.0, err=0.0, maxErr=0.0, rms=0.0, start=0.0;
+	vector acc, diff;
+	start = getTime();
+	for (i=0; i<errorSamples; i++) {
+		o1 = (int)(((long)i * sampleSize) / errorSamples);
+		acc.x=0.0; acc.y=0.0; acc.z=0.0;
+		for (o2=0; o2<sampleSize; o2++) {
+			diff = subVec(getPos(objectsList, o2), getPos(objectsList, o1));
+			dist = magnitude(diff);
+			if (dist > 0) {
+				force = (g * objectsList->mass[o1] * objectsList->mass[o2]) / (dist * dist * dist);
+				acc = addVec(acc, mulVecByScalar(diff, force));
+			}
+		}
+		if (magnitude(acc) == 0.0) {
+			continue;
+		}
+		diff.x = objectsList->fx[o1] - acc.x;
+		diff.y = objectsList->fy[o1] - acc.y;
+		diff.z = objectsList->fz[o1] - acc.z;
+		err = magnitude(diff) / magnitude(acc);
+		maxErr = fmax(maxErr, err);
+		rms += err * err;
+		used++;
+	}
+	rms = used ? sqrt(rms / used) : 0.0;
+	printf("INFO: fmm order %d theta %.2f: %.3f ms, direct %.3f ms (extrapolated), force error rms %.2e max %.2e\n",
+		fmmOrder, theta, elapsed * 1000.0, (getTime() - start) * 1000.0 * sampleSize / errorSamples, rms, maxErr);
+}
+
+
+void bodyForceTask(int task) {
+	int i = 0,
+		last = (task + 1) * blockSize < sampleSize ? (task + 1) * blockSize : sampleSize;
+	vector f;
+	for (i=task*blockSize; i<last; i++) {
+		f = gravitationalForceGrid(i);
+		objectsList->fx[i] = f.x;
+		objectsList->fy[i] = f.y;
+		objectsList->fz[i] = f.z;
+	}
+}
+
+
+void fmmForces(void) {
+	int i = 0;
+	double start = getTime();
+	buildOctree();
+	if (octreeSize > fmmCapacity) {
+		fmmCapacity = octreeCapacity;
+		fmmM = realloc(fmmM, fmmCapacity * fmmNbCoef * sizeof(double));
+		fmmL = realloc(fmmL, fmmCapacity * fmmNbCoef * sizeof(double));
+		fmmRadius = realloc(fmmRadius, fmmCapacity * sizeof(double));
+	}
+	fmmUpward();
+	memset(fmmL, 0, octreeSize * fmmNbCoef * sizeof(double));
+	memset(fmmFx, 0, sampleSize * sizeof(double));
+	memset(fmmFy, 0, sampleSize * sizeof(double));
+	memset(fmmFz, 0, sampleSize * sizeof(double));
+	fmmInteract(0, 0);
+	fmmDownward();
+	for (i=0; i<sampleSize; i++) {
+		objectsList->fx[octreeIndex[i]] = fmmFx[i];
+		objectsList->fy[octreeIndex[i]] = fmmFy[i];
+		objectsList->fz[octreeIndex[i]] = fmmFz[i];
+	}
+	fmmReport(getTime() - start);
+}
+
+
+void computeForces(void) {
+	// fills the force of every body before the integration
+	int i = 0;
+	if (engine == FMM) {
+		fmmForces();
+		return;
+	}
+	if (engine == BARNESHUT) {
+		buildOctree();
+		nbGroups = 0;
+		collectGroups(0);
+	}
+	if (engine == GRID) {
+		buildGrid(&gravityGrid, minPerception);
+	}
+	if ((engine == DIRECT) & singlePrecision) {
+		for (i=0; i<sampleSize; i++) {
+			objectsList->xf[i] = objectsList->x[i];
+			objectsList->yf[i] = objectsList->y[i];
+			objectsList->zf[i] = objectsList->z[i];
+			objectsList->massf[i] = objectsList->mass[i];
+		}
+	}
+	if (engine == DIRECT) {
+		memset(objectsList->fx, 0, sampleSize * sizeof(double));
+		memset(objectsList->fy, 0, sampleSize * sizeof(double));
+		memset(objectsList->fz, 0, sampleSize * sizeof(double));
+		pairForces();
+	} else if (engine == BARNESHUT) {
+		runTasks(nbGroups, treeForceTask);
+	} else {
+		runTasks((sampleSize + blockSize - 1) / blockSize, bodyForceTask);
+	}
+}
+
+
+void precisionReport(void) {
+	// float32 forces against the double kernels on the same initial conditions
+	int i = 0;
+	double err=0.0, maxErr=0.0, rms=0.0;
+	double *ref = malloc(3 * sampleSize * sizeof(double));
+	vector diff;
+	singlePrecision = 0;
+	initKernel();
+	computeForces();
+	for (i=0; i<sampleSize; i++) {
+		ref[3*i] = objectsList->fx[i];
+		ref[3*i+1] = objectsList->fy[i];
+		ref[3*i+2] = objectsList->fz[i];
+	}
+	singlePrecision = 1;
+	initKernel();
+	computeForces();
+	for (i=0; i<sampleSize; i++) {
+		diff.x = objectsList->fx[i] - ref[3*i];
+		diff.y = objectsList->fy[i] - ref[3*i+1];
+		diff.z = objectsList->fz[i] - ref[3*i+2];
+		err = magnitude(diff) / fmax(sqrt((ref[3*i] * ref[3*i]) + (ref[3*i+1] * ref[3*i+1]) + (ref[3*i+2] * ref[3*i+2])), 1.0e-300);
+		maxErr = fmax(maxErr, err);
+		rms += err * err;
+	}
+	rms = sqrt(rms / sampleSize);
+	printf("INFO: float32 forces against double: relative error rms %.2e max %.2e\n", rms, maxErr);
+	free(ref);
+}
+
+
+void addEltPath(int o1) {
+	float *point = &pathArena[3 * ((size_t)pathHead * sampleSize + o1)];
+	point[0] = nextList->x[o1];
+	point[1] = nextList->y[o1];
+	point[2] = nextList->z[o1];
+}
+
+
+void updateTask(int task) {
+	int i = 0,
+		last = (task + 1) * blockSize < sampleSize ? (task + 1) * blockSize : sampleSize;
+	vector acc;
+	particles *p = objectsList,
+		*n = nextList;
+	for (i=task*blockSize; i<last; i++) {
+		n->color[i] = meanColor(i);
+		acc.x = p->fx[i]; acc.y = p->fy[i]; acc.z = p->fz[i];
+		acc = normalize(acc);
+		acc = limitForce(acc, accFactor);
+		n->vx[i] = p->vx[i] + acc.x;
+		n->vy[i] = p->vy[i] + acc.y;
+		n->vz[i] = p->vz[i] + acc.z;
+		n->x[i] = p->x[i] + n->vx[i];
+		n->y[i] = p->y[i] + n->vy[i];
+		n->z[i] = p->z[i] + n->vz[i];
 		addEltPath(i);
 		//keepWithinBounds1(i);
 		//keepWithinBounds2(i);
 	}
-	glutPostRedisplay();
-	glutTimerFunc(dt, update, sampleSize);
+}
+
+
+void step(void) {
+	// one physics step, shared by the window and the batch mode
+	particles *tmp = NULL;
+	// the oldest slot is overwritten once the ring is full
+	pathHead = (pathHead + 1) % maxPathLength;
+	if (pathLength < maxPathLength) {
+		pathLength++;
+	}
+
+	buildGrid(&colorGrid, minDistance);
+	computeForces();
+	runTasks((sampleSize + blockSize - 1) / blockSize, updateTask);
+	tmp = objectsList;
+	objectsList = nextList;
+	nextList = tmp;
+}
+
+
+void *simulate(void *arg) {
+	// sim thread of the window, it publishes every step and only waits to
+	// keep stepPeriod between two steps
+	double start = 0.0,
+		wait = 0.0;
+	struct timespec pause;
+	(void)arg;
+	while (!atomic_load(&simStop)) {
+		start = getTime();
+		step();
+		stepCount++;
+		publishSnapshot();
+		if (trajectory != NULL) {
+			queueTrajectory();
+		}
+		if ((saveEvery > 0) && (stepCount % saveEvery == 0)) {
+			saveCheckpoint();
+		}
+		wait = stepPeriod - (getTime() - start) * 1000.0;
+		if (wait > 0) {
+			pause.tv_sec = (time_t)(wait / 1000.0);
+			pause.tv_nsec = (long)(fmod(wait, 1000.0) * 1.0e6);
+			nanosleep(&pause, NULL);
+		}
+	}
+	return(NULL);
+}
+
+
+void runBatch(void) {
+	int i = 0;
+	double start = 0.0,
+		elapsed = 0.0;
+	if (renderEvery > 0) {
+		initRender();
+		startEncoders();
+	}
+	if (trajectory != NULL) {
+		startTrajectory();
+	}
+	start = getTime();
+	for (i=0; i<batchSteps; i++) {
+		if ((renderEvery > 0) && (i % renderEvery == 0)) {
+			queueScene();
+		}
+		step();
+		stepCount++;
+		if ((saveEvery > 0) && (stepCount % saveEvery == 0)) {
+			saveCheckpoint();
+		}
+		if (trajectory != NULL) {
+			queueTrajectory();
+		}
+	}
+	elapsed = getTime() - start;
+	printf("INFO: %d steps of %d bodies in %.3f s, %.2f steps/s\n", batchSteps, sampleSize, elapsed, batchSteps / elapsed);
+	if (trajectory != NULL) {
+		finishTrajectory();
+		checkTrajectory();
+	}
+	if (renderEvery > 0) {
+		waitEncoders();
+		if (video == NULL) {
+			printf("INFO: %d frames written to frame_NNNNN.png, %.3f s after the last step\n", renderCount, getTime() - start - elapsed);
+		}
+		closeVideo();
+	}
+	finishCheckpoint();
 }
 
 
@@ -741,6 +4109,9 @@ void init(void) {
 	glEnable(GL_AUTO_NORMAL);
 	glEnable(GL_CULL_FACE);
 	glDepthFunc(GL_LESS);
+	initSpheres();
+	initTrails();
+	initCapture();
 }
 
 
@@ -758,8 +4129,17 @@ void glmain(int argc, char *argv[]) {
 	glutMouseFunc(onMouse);
 	glutKeyboardFunc(onKeyboard);
 	glutTimerFunc(dt, onTimer, 0);
-	glutTimerFunc(dt, update, sampleSize);
 	init();
+	allocateSnapshots();
+	publishSnapshot();
+	acquireSnapshot();
+	if (trajectory != NULL) {
+		startTrajectory();
+	}
+	if (pthread_create(&simThread, NULL, simulate, NULL) != 0) {
+		printf("ERROR: cannot start the simulation thread\n");
+		exit(EXIT_FAILURE);
+	}
 	fprintf(stdout, "INFO: OpenGL Version: %s\n", glGetString(GL_VERSION));
 	fprintf(stdout, "INFO: Screen size (%d, %d)\n", glutGet(GLUT_SCREEN_WIDTH), glutGet(GLUT_SCREEN_HEIGHT));
 	fprintf(stdout, "INFO: Nbr elts: %d\n", sampleSize);
@@ -769,32 +4149,244 @@ void glmain(int argc, char *argv[]) {
 }
 
 
+void readCheckpointHeader(checkpointHeader *h) {
+	// sizes of the restart, they replace -n and -r
+	int fd = open(restartName, O_RDONLY);
+	if ((fd < 0) || (read(fd, h, sizeof(checkpointHeader)) != sizeof(checkpointHeader)) || memcmp(h->magic, "UNIVERSE", 8)) {
+		printf("ERROR: %s is not a universe3d checkpoint\n", restartName);
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	if ((h->version != CHECKPOINTVERSION) || (h->sections != CHECKPOINTSECTIONS)) {
+		printf("ERROR: %s is a checkpoint of version %d, version %d is expected\n", restartName, h->version, CHECKPOINTVERSION);
+		exit(EXIT_FAILURE);
+	}
+	sampleSize = h->bodies;
+	maxPathLength = h->pathPoints;
+}
+
+
+void loadCheckpoint(void) {
+	// replaces populateObjects, the mapping is read ahead and copied section by section
+	checkpointHeader h, layout;
+	char *data[CHECKPOINTSECTIONS];
+	char *map = NULL;
+	struct stat st;
+	int i = 0,
+		fd = 0;
+	double start = getTime();
+	readCheckpointHeader(&h);
+	allocateObjects();
+	pathArena = alignedArray(3 * maxPathLength, sampleSize * sizeof(float));
+	pathHead = h.pathHead;
+	pathLength = h.pathLength;
+	stepCount = h.steps;
+	checkpointLayout(&layout, data);
+	fd = open(restartName, O_RDONLY);
+	if ((fd < 0) || (fstat(fd, &st) != 0) || (st.st_size < layout.offset[CHECKPOINTSECTIONS-1] + layout.size[CHECKPOINTSECTIONS-1])) {
+		printf("ERROR: %s is truncated\n", restartName);
+		exit(EXIT_FAILURE);
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	if (map == MAP_FAILED) {
+		printf("ERROR: cannot map %s\n", restartName);
+		exit(EXIT_FAILURE);
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	for (i=0; i<CHECKPOINTSECTIONS; i++) {
+		if ((h.offset[i] != layout.offset[i]) || (h.size[i] != layout.size[i])) {
+			printf("ERROR: section %d of %s does not match its header\n", i, restartName);
+			exit(EXIT_FAILURE);
+		}
+		memcpy(data[i], map + h.offset[i], h.size[i]);
+	}
+	munmap(map, st.st_size);
+	close(fd);
+	printf("INFO: %d bodies restarted at step %ld from %s in %.3f s\n", sampleSize, stepCount, restartName, getTime() - start);
+}
+
+
 void populateObjects(void) {
 	int i = 0;
+	particles *p = NULL;
+	allocateObjects();
+	pathArena = alignedArray(3 * maxPathLength, sampleSize * sizeof(float));
+	pathHead = 0;
+	pathLength = 1;
+	p = objectsList;
 	for (i=0; i<sampleSize; i++) {
-		objectsList[i].id = i;
-		objectsList[i].selected = 0;
-		objectsList[i].color.x = generateFloatRandom();
-		objectsList[i].color.y = generateFloatRandom();
-		objectsList[i].color.z = generateFloatRandom();
-		objectsList[i].pos.x = generatePosRandom();
-		objectsList[i].pos.y = generatePosRandom();
-		objectsList[i].pos.z = generatePosRandom();
-		objectsList[i].velocity.x = generateRangeRandom(-1.00, 1.00);
-		objectsList[i].velocity.y = generateRangeRandom(-1.00, 1.00);
-		objectsList[i].velocity.z = generateRangeRandom(-1.00, 1.00);
-		objectsList[i].mass = generateRangeRandom(minWeight, maxWeight);
-		objectsList[i].radius = pow(((3.0 * objectsList[i].mass) / (4.0 * pi * density)), (1.0/3.0));
-		objectsList[i].path = calloc(maxPathLength, sizeof(vector));
-		objectsList[i].path[pathLength] = objectsList[i].pos;
+		p->selected[i] = 0;
+		p->color[i].x = generateFloatRandom();
+		p->color[i].y = generateFloatRandom();
+		p->color[i].z = generateFloatRandom();
+		p->x[i] = generatePosRandom();
+		p->y[i] = generatePosRandom();
+		p->z[i] = generatePosRandom();
+		p->vx[i] = generateRangeRandom(-1.00, 1.00);
+		p->vy[i] = generateRangeRandom(-1.00, 1.00);
+		p->vz[i] = generateRangeRandom(-1.00, 1.00);
+		p->mass[i] = generateRangeRandom(minWeight, maxWeight);
+		p->radius[i] = pow(((3.0 * p->mass[i]) / (4.0 * pi * density)), (1.0/3.0));
+		pathArena[3*i] = p->x[i];
+		pathArena[3*i+1] = p->y[i];
+		pathArena[3*i+2] = p->z[i];
+	}
+}
+
+
+void parseOptions(int argc, char *argv[]) {
+	char *engineName[] = {"direct", "bh", "fmm", "grid"};
+	checkpointHeader restart;
+	int opt = 0,
+		k = 0;
+	while ((opt = getopt(argc, argv, "e:t:p:l:j:k:fub:n:r:d:o:v:s:i:x:X:")) != -1) {
+		switch (opt) {
+			case 'e':
+				if (!strcmp(optarg, "direct")) {
+					engine = DIRECT;
+				} else if (!strcmp(optarg, "bh")) {
+					engine = BARNESHUT;
+				} else if (!strcmp(optarg, "fmm")) {
+					engine = FMM;
+				} else if (!strcmp(optarg, "grid")) {
+					engine = GRID;
+				} else {
+					printf("ERROR: unknown engine %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 't':
+				theta = atof(optarg);
+				break;
+			case 'p':
+				fmmOrder = atoi(optarg);
+				if (fmmOrder < 1) {
+					printf("ERROR: FMM order must be at least 1\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'l':
+				leafSize = atoi(optarg);
+				break;
+			case 'j':
+				nbThreads = atoi(optarg);
+				break;
+			case 'b':
+				batchSteps = atoi(optarg);
+				break;
+			case 'd':
+				stepPeriod = atof(optarg);
+				break;
+			case 'o':
+				renderEvery = atoi(optarg);
+				break;
+			case 'v':
+				videoName = optarg;
+				break;
+			case 'x':
+				trajectoryName = optarg;
+				break;
+			case 'X':
+				openDump(optarg);
+				break;
+			case 's':
+				saveEvery = atoi(optarg);
+				break;
+			case 'i':
+				restartName = optarg;
+				break;
+			case 'r':
+				maxPathLength = atoi(optarg);
+				if (maxPathLength < 1) {
+					printf("ERROR: trails need at least one point\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'n':
+				sampleSize = atoi(optarg);
+				if (sampleSize < 1) {
+					printf("ERROR: at least one body is needed\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'k':
+				kernel = -1;
+				for (k=KERNEL_SCALAR; k<=KERNEL_AVX512; k++) {
+					if (!strcmp(optarg, kernelName[k])) {
+						kernel = k;
+					}
+				}
+				if (kernel < 0) {
+					printf("ERROR: unknown kernel %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'f':
+				singlePrecision = 1;
+				break;
+			case 'u':
+				cutoff = 0;
+				break;
+			default:
+				exit(EXIT_FAILURE);
+				break;
+		}
+	}
+	if (restartName != NULL) {
+		readCheckpointHeader(&restart);
+	}
+	if ((engine == FMM) & cutoff) {
+		printf("INFO: fmm ignores minPerception, gravity range is unlimited\n");
+		cutoff = 0;
+	}
+	if ((engine == GRID) & !cutoff) {
+		printf("ERROR: the grid engine needs the minPerception cutoff\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((renderEvery > 0) && (batchSteps < 1)) {
+		printf("ERROR: offscreen frames are drawn in the batch mode, add -b steps\n");
+		exit(EXIT_FAILURE);
+	}
+	if (leafSize < 1) {
+		leafSize = (engine == FMM) ? 32 : 8;
+	}
+	if (engine == FMM) {
+		initFmm();
 	}
+	initKernel();
+	initPool();
+	initTiles();
+	// the outputs are created once the options are known to be valid
+	if (videoName != NULL) {
+		openVideo();
+	}
+	if (trajectoryName != NULL) {
+		openTrajectory();
+	}
+	printf("INFO: engine %s, theta %.2f, cutoff %d, %s kernel in %s, %d threads\n", engineName[engine], theta, cutoff, kernelName[kernel], singlePrecision ? "float32" : "double", nbThreads);
 }
 
 
 int main(int argc, char *argv[]) {
 	help();
+	parseOptions(argc, argv);
+	if (dumpName != NULL) {
+		dumpTrajectory();
+		exit(EXIT_SUCCESS);
+	}
 	srand(time(NULL));
-	populateObjects();
-	glmain(argc, argv);
+	if (restartName != NULL) {
+		loadCheckpoint();
+	} else {
+		populateObjects();
+	}
+	if (singlePrecision) {
+		precisionReport();
+	}
+	if (batchSteps > 0) {
+		runBatch();
+	} else {
+		glmain(argc, argv);
+	}
 	exit(EXIT_SUCCESS);
 }